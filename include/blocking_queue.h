@@ -6,6 +6,8 @@
 #include <utility>
 #include <vector>
 #include <queue>
+#include <deque>
+#include <array>
 
 namespace jlcommon {
 
@@ -23,10 +25,12 @@ class BlockingQueue {
 	 * Getters
 	 */
 	[[nodiscard]] int size() const noexcept {
+		std::lock_guard<std::mutex> lk(mLock);
 		return implSize();
 	}
 	
 	[[nodiscard]] bool empty() const noexcept {
+		std::lock_guard<std::mutex> lk(mLock);
 		return implSize() <= 0;
 	}
 	
@@ -160,7 +164,7 @@ class BlockingQueue {
 	[[nodiscard]] virtual size_t implSize() const = 0;
 	
 	private:
-	std::mutex mLock;
+	mutable std::mutex mLock;
 	std::condition_variable mCondition;
 	bool mAllowBlocking;
 	
@@ -228,5 +232,55 @@ class PriorityBlockingQueue final : public BlockingQueue<T> {
 	std::priority_queue<T> mData;
 };
 
+/**
+ * A FIFO per priority level that always serves the highest non-empty level first. To protect lower levels from
+ * starvation, a waiting level that has been passed over StarvationLimit times in a row is served next.
+ * @tparam PriorityOf functor returning the level of an item, in [0, Levels), where higher levels are served first
+ */
+template <typename T, size_t Levels, typename PriorityOf, size_t StarvationLimit = 64>
+class MultiLevelBlockingQueue final : public BlockingQueue<T> {
+	static_assert(Levels > 0, "MultiLevelBlockingQueue requires at least one level");
+	
+	public:
+	MultiLevelBlockingQueue() : BlockingQueue<T>(), mData(), mSkipped(), mSize(0), mSelected(0) { }
+	
+	protected:
+	void implAdd(T && item) final { mData[getLevel(item)].emplace_back(std::move(item)); mSize++; };
+	void implAdd(const T & item) final { mData[getLevel(item)].emplace_back(item); mSize++; };
+	void implPeek(T & item) final { mSelected = selectLevel(); item = std::move(mData[mSelected].front()); };
+	void implPoll() final {
+		mData[mSelected].pop_front();
+		mSize--;
+		mSkipped[mSelected] = 0;
+		for (size_t level = 0; level < mSelected; level++) {
+			if (!mData[level].empty())
+				mSkipped[level]++;
+		}
+	};
+	[[nodiscard]] size_t implSize() const final { return mSize; };
+	
+	private:
+	std::array<std::deque<T>, Levels> mData;
+	std::array<size_t, Levels> mSkipped;
+	size_t mSize;
+	size_t mSelected;
+	
+	static inline size_t getLevel(const T & item) {
+		const size_t level = PriorityOf{}(item);
+		return level < Levels ? level : Levels - 1;
+	}
+	
+	size_t selectLevel() const {
+		size_t highest = Levels - 1;
+		while (highest > 0 && mData[highest].empty())
+			highest--;
+		for (size_t level = 0; level < highest; level++) {
+			if (!mData[level].empty() && mSkipped[level] >= StarvationLimit)
+				return level;
+		}
+		return highest;
+	}
+};
+
 } // namespace jlcommon
 
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace jlcommon {
+
+/**
+ * Watches many file descriptors and timers from one or a few threads, with edge-triggered epoll, instead of a thread
+ * per descriptor. Each descriptor belongs to one loop thread, picked when it is added, so its handler never runs
+ * concurrently with itself; handlers of different descriptors on the same thread run one after the other and should
+ * not block.
+ */
+class EventLoop {
+	public:
+	using Handler = std::function<void(uint32_t events)>;
+	using Task = std::function<void()>;
+	
+	explicit EventLoop(size_t threads = 1);
+	~EventLoop();
+	EventLoop(const EventLoop &) = delete;
+	EventLoop & operator=(const EventLoop &) = delete;
+	
+	/**
+	 * Watches fd until remove(). Being edge-triggered, the handler is only called again once more becomes ready, so it
+	 * must consume everything available, e.g. read until EAGAIN (or with MSG_DONTWAIT) each time.
+	 * @param events EPOLLIN, EPOLLOUT, ...; EPOLLET is added
+	 * @return an id for remove(), or 0 on failure
+	 */
+	uint64_t add(int fd, uint32_t events, Handler handler);
+	
+	/**
+	 * Calls task after delay, then every period if it is not zero
+	 * @return an id for remove(), or 0 on failure
+	 */
+	uint64_t addTimer(std::chrono::milliseconds delay, std::chrono::milliseconds period, Task task);
+	
+	/**
+	 * Stops watching a descriptor or cancels a timer. Once this returns its handler is not running and never runs
+	 * again, except when called from that handler, which then simply finishes. Waits for the owning loop thread, so
+	 * a handler on one loop thread must not remove a source of another thread which may be doing the same, and the
+	 * loop must outlive whoever removes its sources.
+	 */
+	void remove(uint64_t id);
+	
+	/**
+	 * Runs task on a loop thread
+	 */
+	void post(Task task);
+	
+	[[nodiscard]] inline size_t getThreadCount() const noexcept { return mWorkers.size(); }
+	[[nodiscard]] bool isInLoopThread() const noexcept;
+	
+	private:
+	struct Source {
+		uint64_t id;
+		int fd;
+		Handler handler;
+		Task task;     // for a timer, whose timerfd the loop owns
+		bool periodic;
+		bool active;
+	};
+	
+	struct Worker {
+		int epollFd{-1};
+		int wakeFd{-1};
+		std::thread thread;
+		std::mutex lock;
+		std::vector<Task> tasks;
+		std::vector<std::unique_ptr<Source>> retired; // removed during dispatch, freed after it
+		std::atomic_size_t sourceCount{0};
+	};
+	
+	std::vector<std::unique_ptr<Worker>> mWorkers;
+	std::atomic_bool mRunning;
+	std::mutex mLock;
+	std::unordered_map<uint64_t, std::pair<Worker *, Source *>> mSources;
+	uint64_t mNextId;
+	std::atomic_size_t mNextPost;
+	
+	uint64_t addSource(int fd, uint32_t events, Source * source);
+	void run(Worker & worker);
+	void runTasks(Worker & worker);
+	void runOn(Worker & worker, Task task);
+	void detach(Worker & worker, Source * source);
+	void dispatch(Source & source, uint32_t events);
+};
+
+} // namespace jlcommon
@@ -5,6 +5,10 @@
 #pragma once
 
 #include "blocking_queue.h"
+#include "thread_pool.h"
+#include "latency_histogram.h"
+#include "resource_account.h"
+#include "trace.h"
 #include "log.h"
 
 #include <unordered_map>
@@ -13,22 +17,107 @@
 #include <algorithm>
 #include <memory>
 #include <functional>
-#include <typeindex>
+#include <typeinfo>
 #include <type_traits>
 #include <atomic>
+#include <array>
 #include <utility>
 #include <map>
-#include <tuple>
 #include <string>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 namespace jlcommon {
 
 template<typename T>
 using IntentCallback = std::function<void(const T &)>;
-using IntentCallbackCompiled = std::function<void()>;
+
+/**
+ * How handler run time and queue wait are measured. Defining JLCOMMON_DISABLE_INTENT_TIMING compiles the measurement out
+ * entirely, regardless of the mode.
+ */
+enum class IntentTimingMode {
+	OFF,     // no clock reads or histogram updates
+	FULL,    // every invocation is measured
+	SAMPLED  // on average one in every N invocations per thread is measured
+};
+
+/**
+ * Order in which queued intents are executed by run() and runUntilEmpty(). Higher priorities always run first, except
+ * that a waiting lower priority is guaranteed a turn after being passed over too many times in a row.
+ */
+enum class IntentPriority : uint8_t {
+	LOW,
+	NORMAL,
+	HIGH,
+	CRITICAL
+};
+
+/**
+ * Identifies a single subscription, so that it can later be removed with IntentManager::unsubscribe
+ */
+struct IntentSubscription {
+	size_t slot = 0;
+	uint64_t id = 0; // 0 if the subscription failed
+	
+	[[nodiscard]] inline bool isValid() const noexcept { return id != 0; }
+};
+
+/**
+ * What happens to a broadcast when a subscriber already has its limit of pending intents
+ */
+enum class IntentOverflowPolicy : uint8_t {
+	BLOCK,       // the broadcaster waits for the subscriber to catch up
+	DROP_NEWEST, // the subscriber misses the new intent
+	DROP_OLDEST, // the subscriber's oldest pending intent is discarded to make room
+	REJECT       // the broadcast is refused as a whole, and no subscriber receives it
+};
+
+/**
+ * Outcome of a broadcast. Converts to the number of subscribers that accepted the intent.
+ */
+struct IntentBroadcastResult {
+	unsigned int handlers = 0; // subscribers that ran or queued the intent
+	unsigned int dropped = 0;  // pending intents shed to make room, or subscribers that missed this one
+	unsigned int blocked = 0;  // subscribers the broadcaster had to wait for
+	bool rejected = false;     // a subscriber with the REJECT policy was full, so nothing was delivered
+	
+	inline operator unsigned int() const noexcept { return handlers; } // NOLINT(google-explicit-constructor)
+};
+
+struct IntentQueueStats {
+	std::string intent;
+	std::string subscriber;
+	size_t maxPending;  // 0 if unlimited
+	size_t pending;     // intents waiting in the limited mailbox
+	uint64_t dropped;   // by DROP_NEWEST or DROP_OLDEST
+	uint64_t rejected;  // broadcasts refused because of this subscriber
+	uint64_t blocked;   // broadcasts that had to wait for this subscriber
+};
+
+struct IntentTimingSnapshot {
+	std::string intent;
+	std::string subscriber;
+	LatencySnapshot runTime;   // handler execution
+	LatencySnapshot queueWait; // broadcast until the handler started
+};
 
 namespace IntentManagerHelper {
 
+inline std::atomic_size_t nextIntentSlot{0};
+
+/**
+ * Returns the process-wide slot for the intent type, assigned the first time the type is used. Slots are dense, so they
+ * can directly index the per-type runners of an IntentManager.
+ */
+template<typename T>
+inline size_t getIntentSlot() noexcept {
+	static const size_t slot = nextIntentSlot++;
+	return slot;
+}
+
 class GenericIntentRunner {
 	public:
 	virtual ~GenericIntentRunner() = default;
@@ -37,133 +126,1394 @@ class GenericIntentRunner {
 		throw std::exception();
 	}
 	
+	virtual void getIntentTimingSnapshot(std::vector<IntentTimingSnapshot> & snapshots) {
+		(void) snapshots;
+	}
+	
+	virtual void setTimingInterval(uint32_t interval) {
+		(void) interval;
+	}
+	
+	virtual void getIntentQueueStats(std::vector<IntentQueueStats> & stats) {
+		(void) stats;
+	}
+	
+	virtual void setResourceAccounting(bool accounting) {
+		(void) accounting;
+	}
+	
+	virtual bool unsubscribe(uint64_t id) {
+		(void) id;
+		return false;
+	}
+
+};
+
+struct TimingSampler {
+	uint32_t countdown = 1;
+	uint32_t random = 0x9E3779B9u;
 };
 
+// Broadcasts and invocations count separately, so that each keeps its rate when both happen on the same thread
+inline thread_local TimingSampler invocationSampler;
+inline thread_local TimingSampler broadcastSampler;
+
+/**
+ * Decides whether this invocation should be measured, using only thread-local state
+ * @param interval 0 to never measure, 1 to always measure, or N to measure on average one in N invocations
+ */
+inline bool shouldSampleTiming(uint32_t interval, TimingSampler & sampler = invocationSampler) noexcept {
+	if (interval <= 1)
+		return interval == 1;
+	if (--sampler.countdown != 0)
+		return false;
+	// Randomize the next gap within [1, 2N) so a fixed handler rotation cannot alias with the interval
+	sampler.random ^= sampler.random << 13;
+	sampler.random ^= sampler.random >> 17;
+	sampler.random ^= sampler.random << 5;
+	sampler.countdown = 1 + sampler.random % (2 * interval - 1);
+	return true;
+}
+
+class IntentStrand;
+
 template<typename T>
 class IntentHandler : public GenericIntentRunner {
 	public:
-	IntentHandler(const IntentCallback<T> && handler, std::string && name): handler(std::move(handler)), name(std::move(name)) {}
+	IntentHandler(uint64_t id, const IntentCallback<T> && handler, std::string && name, std::shared_ptr<IntentStrand> strand, std::shared_ptr<ResourceAccount> account, bool inlineDispatch, int priority): id(id), handler(std::move(handler)), name(std::move(name)), strand(std::move(strand)), account(std::move(account)), inlineDispatch(inlineDispatch), priority(priority) {}
+	const uint64_t id;
 	const IntentCallback<T> handler;
 	const std::string name;
+	const std::shared_ptr<IntentStrand> strand;
+	const std::shared_ptr<ResourceAccount> account; // of the subscriber
+	const bool inlineDispatch; // runs on the broadcasting thread instead of being queued
+	const int priority;        // IntentPriority of this subscription, or -1 to use the intent type's priority
+	bool hasOwnQueueLimit = false; // set for this subscriber, instead of inherited from the intent type
 	
 	void addTime(uint64_t time) {
-		totalRunTime += time;
-		totalRunCount++;
+		runTime.record(time);
 	}
 	
 	uint64_t getAverageTimeNanoseconds() {
-		if (totalRunCount == 0)
+		const uint64_t count = runTime.getCount();
+		if (count == 0)
 			return 0;
-		return totalRunTime / totalRunCount;
+		return runTime.getSum() / count;
 	}
 	
 	inline void operator()(const T & arg) const { handler(std::move(arg)); }
 	
+	/**
+	 * Runs the handler with timing, logging anything it throws
+	 * @param queuedAt when the intent was broadcast, to track how long it waited to be handled
+	 */
+	void invoke(const T & arg, std::chrono::steady_clock::time_point queuedAt) noexcept {
+		if (!mSubscribed.load(std::memory_order_acquire))
+			return;
+		Trace::Span span("intent", typeid(T).name(), name.c_str());
+		if (mAccounting.load(std::memory_order_relaxed)) {
+			ResourceAccount::Scope scope(*account, ResourceAccount::Scope::INTENT);
+			invokeTimed(arg, queuedAt);
+		} else {
+			invokeTimed(arg, queuedAt);
+		}
+	}
+	
+	/**
+	 * Charges the CPU time and count of invocations to the subscriber's ResourceAccount
+	 */
+	inline void setResourceAccounting(bool accounting) noexcept {
+		mAccounting.store(accounting, std::memory_order_relaxed);
+	}
+	
+	enum class Offer {
+		QUEUED,   // a task must be dispatched to deliver it
+		REPLACED, // an older pending intent was dropped instead, whose task will deliver this one
+		DROPPED,
+		CANCELLED
+	};
+	
+	/**
+	 * Limits how many intents may wait for this subscriber. Beyond that, intents go through the mailbox instead of the
+	 * execution queue, so that the overflow policy can act on them.
+	 * @param maxPending 0 for no limit
+	 */
+	void setQueueLimit(size_t maxPending, IntentOverflowPolicy policy) {
+		std::lock_guard<std::mutex> lk(mPendingLock);
+		mMaxPending.store(maxPending, std::memory_order_relaxed);
+		mOverflowPolicy.store(policy, std::memory_order_relaxed);
+		mPendingSpace.notify_all();
+	}
+	
+	[[nodiscard]] inline bool isLimited() const noexcept { return mMaxPending.load(std::memory_order_relaxed) != 0; }
+	[[nodiscard]] inline IntentOverflowPolicy getOverflowPolicy() const noexcept { return mOverflowPolicy.load(std::memory_order_relaxed); }
+	
+	/**
+	 * Returns TRUE if the subscriber's mailbox is full and its policy is to reject further broadcasts
+	 */
+	[[nodiscard]] inline bool isRejecting() {
+		if (getOverflowPolicy() != IntentOverflowPolicy::REJECT)
+			return false;
+		std::lock_guard<std::mutex> lk(mPendingLock);
+		const size_t maxPending = mMaxPending.load(std::memory_order_relaxed);
+		return maxPending != 0 && mPending.size() >= maxPending;
+	}
+	
+	inline void countRejected() noexcept { mRejected.fetch_add(1, std::memory_order_relaxed); }
+	
+	/**
+	 * Adds the payload to the mailbox, applying the overflow policy if it is full
+	 * @param blocked set to TRUE if the broadcaster had to wait
+	 */
+	Offer offer(const std::shared_ptr<const T> & payload, std::chrono::steady_clock::time_point queuedAt, bool & blocked) {
+		std::unique_lock<std::mutex> lk(mPendingLock);
+		while (true) {
+			const size_t maxPending = mMaxPending.load(std::memory_order_relaxed);
+			if (!mSubscribed.load(std::memory_order_acquire))
+				return Offer::CANCELLED;
+			if (maxPending == 0 || mPending.size() < maxPending) {
+				mPending.emplace_back(payload, queuedAt);
+				return Offer::QUEUED;
+			}
+			switch (mOverflowPolicy.load(std::memory_order_relaxed)) {
+				case IntentOverflowPolicy::BLOCK:
+					if (!blocked)
+						mBlocked.fetch_add(1, std::memory_order_relaxed);
+					blocked = true;
+					mPendingSpace.wait(lk);
+					continue;
+				case IntentOverflowPolicy::DROP_OLDEST:
+					mPending.pop_front();
+					mPending.emplace_back(payload, queuedAt);
+					mDropped.fetch_add(1, std::memory_order_relaxed);
+					return Offer::REPLACED;
+				case IntentOverflowPolicy::REJECT: // lost a race with another broadcaster after the check
+				case IntentOverflowPolicy::DROP_NEWEST:
+					mDropped.fetch_add(1, std::memory_order_relaxed);
+					return Offer::DROPPED;
+			}
+		}
+	}
+	
+	/**
+	 * Removes the oldest intent from the mailbox
+	 * @return FALSE if the mailbox is empty
+	 */
+	bool takePending(std::shared_ptr<const T> & payload, std::chrono::steady_clock::time_point & queuedAt) {
+		std::lock_guard<std::mutex> lk(mPendingLock);
+		if (mPending.empty())
+			return false;
+		payload = std::move(mPending.front().first);
+		queuedAt = mPending.front().second;
+		mPending.pop_front();
+		mPendingSpace.notify_one();
+		return true;
+	}
+	
+	/**
+	 * Stops any further invocations, including those of tasks that are already queued
+	 */
+	inline void cancel() noexcept {
+		mSubscribed.store(false, std::memory_order_release);
+		std::lock_guard<std::mutex> lk(mPendingLock);
+		mPending.clear();
+		mPendingSpace.notify_all();
+	}
+	
+	/**
+	 * @param interval 0 to disable timing, 1 to time every invocation, or N to time one in N invocations
+	 */
+	inline void setTimingInterval(uint32_t interval) noexcept {
+		mTimingInterval.store(interval, std::memory_order_relaxed);
+	}
+	
+	[[nodiscard]] IntentTimingSnapshot getTimingSnapshot() const {
+		return IntentTimingSnapshot{typeid(T).name(), name, runTime.snapshot(), queueWait.snapshot()};
+	}
+	
+	[[nodiscard]] IntentQueueStats getQueueStats() const {
+		std::lock_guard<std::mutex> lk(mPendingLock);
+		return IntentQueueStats{typeid(T).name(), name, mMaxPending.load(std::memory_order_relaxed), mPending.size(),
+				mDropped.load(std::memory_order_relaxed), mRejected.load(std::memory_order_relaxed), mBlocked.load(std::memory_order_relaxed)};
+	}
+	
+	private:
+	inline void invokeTimed(const T & arg, std::chrono::steady_clock::time_point queuedAt) noexcept {
+		try {
+#ifndef JLCOMMON_DISABLE_INTENT_TIMING
+			// The wait is recorded for every sampled broadcast, whether or not this invocation is measured as well
+			std::chrono::steady_clock::time_point begin{};
+			if (queuedAt != std::chrono::steady_clock::time_point{}) {
+				begin = std::chrono::steady_clock::now();
+				queueWait.record(std::chrono::duration_cast<std::chrono::nanoseconds>(begin-queuedAt).count());
+			}
+			if (shouldSampleTiming(mTimingInterval.load(std::memory_order_relaxed))) {
+				if (begin == std::chrono::steady_clock::time_point{})
+					begin = std::chrono::steady_clock::now();
+				(*this)(arg);
+				auto end = std::chrono::steady_clock::now();
+				addTime(std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count());
+				return;
+			}
+#else
+			(void) queuedAt;
+#endif
+			(*this)(arg);
+		} catch (const std::exception &e) {
+			Log::error("Exception thrown when handling %s in %s. %s", typeid(T).name(), name.c_str(), e.what());
+		} catch (const std::string &s) {
+			Log::error("Exception thrown when handling %s in %s. %s", typeid(T).name(), name.c_str(), s.c_str());
+		} catch (const char *s) {
+			Log::error("Exception thrown when handling %s in %s. %s", typeid(T).name(), name.c_str(), s);
+		} catch (...) {
+			Log::error("Exception thrown when handling %s in %s. Unknown Error.", typeid(T).name(), name.c_str());
+		}
+	}
+	
+	LatencyHistogram runTime;
+	LatencyHistogram queueWait;
+	std::atomic_uint32_t mTimingInterval{1};
+	std::atomic_bool mAccounting{false};
+	std::atomic_bool mSubscribed{true};
+	mutable std::mutex mPendingLock;
+	std::condition_variable mPendingSpace;
+	std::deque<std::pair<std::shared_ptr<const T>, std::chrono::steady_clock::time_point>> mPending;
+	std::atomic_size_t mMaxPending{0};
+	std::atomic<IntentOverflowPolicy> mOverflowPolicy{IntentOverflowPolicy::DROP_NEWEST};
+	std::atomic_uint64_t mDropped{0};
+	std::atomic_uint64_t mRejected{0};
+	std::atomic_uint64_t mBlocked{0};
+};
+
+/**
+ * A function posted to a subscriber's strand, e.g. a scheduled callback of a service
+ */
+class PostedTask {
+	public:
+	PostedTask(std::string name, std::function<void()> task) : mName(std::move(name)), mTask(std::move(task)) { }
+	
+	/**
+	 * Runs the function, logging anything it throws
+	 */
+	void run() const noexcept {
+		Trace::Span span("task", "posted", mName.c_str());
+		try {
+			mTask();
+		} catch (const std::exception &e) {
+			Log::error("Exception thrown when running a task of %s. %s", mName.c_str(), e.what());
+		} catch (const std::string &s) {
+			Log::error("Exception thrown when running a task of %s. %s", mName.c_str(), s.c_str());
+		} catch (const char *s) {
+			Log::error("Exception thrown when running a task of %s. %s", mName.c_str(), s);
+		} catch (...) {
+			Log::error("Exception thrown when running a task of %s. Unknown Error.", mName.c_str());
+		}
+	}
+	
 	private:
-	std::atomic_uint64_t totalRunTime{0};
-	std::atomic_uint64_t totalRunCount{0};
+	const std::string mName;
+	const std::function<void()> mTask;
+};
+
+/**
+ * A queued invocation of one intent handler. The task only references the handler and the payload shared by every
+ * subscriber, so queueing it neither copies the intent nor allocates.
+ */
+class IntentTask {
+	public:
+	IntentTask() noexcept = default;
+	template<typename T>
+	IntentTask(std::shared_ptr<IntentHandler<T>> handler, std::shared_ptr<const T> payload, std::chrono::steady_clock::time_point queuedAt, IntentPriority priority) noexcept :
+			mInvoke(&invoke<T>),
+			mHandler(std::move(handler)),
+			mPayload(std::move(payload)),
+			mQueuedAt(queuedAt),
+			mPriority(priority) { }
+	
+	/**
+	 * Creates a task that delivers the oldest intent in the handler's mailbox when it runs
+	 */
+	template<typename T>
+	IntentTask(std::shared_ptr<IntentHandler<T>> handler, std::chrono::steady_clock::time_point queuedAt, IntentPriority priority) noexcept :
+			mInvoke(&invokeLatest<T>),
+			mHandler(std::move(handler)),
+			mPayload(),
+			mQueuedAt(queuedAt),
+			mPriority(priority) { }
+	
+	IntentTask(std::shared_ptr<PostedTask> task, IntentPriority priority) noexcept :
+			mInvoke(&invokePosted),
+			mHandler(std::move(task)),
+			mPayload(),
+			mQueuedAt(),
+			mPriority(priority) { }
+	
+	inline void operator()() const;
+	
+	explicit inline operator bool() const noexcept { return mInvoke != nullptr; }
+	
+	[[nodiscard]] inline IntentPriority getPriority() const noexcept { return mPriority; }
+	
+	/**
+	 * Counts the task as queued for run() by its strand until it has run, see IntentStrand::queueForRun()
+	 */
+	inline void setQueuedIn(IntentStrand * strand) noexcept { mQueuedIn = strand; }
+	
+	private:
+	void (*mInvoke)(const IntentTask &) = nullptr;
+	IntentStrand * mQueuedIn{nullptr}; // owned by the IntentManager, which outlives its queue
+	std::shared_ptr<void> mHandler;
+	std::shared_ptr<const void> mPayload;
+	std::chrono::steady_clock::time_point mQueuedAt;
+	IntentPriority mPriority{IntentPriority::NORMAL};
+	
+	template<typename T>
+	static void invoke(const IntentTask & task) {
+		static_cast<IntentHandler<T>*>(task.mHandler.get())->invoke(*static_cast<const T*>(task.mPayload.get()), task.mQueuedAt);
+	}
+	
+	template<typename T>
+	static void invokeLatest(const IntentTask & task) {
+		auto handler = static_cast<IntentHandler<T>*>(task.mHandler.get());
+		std::shared_ptr<const T> payload;
+		std::chrono::steady_clock::time_point queuedAt;
+		if (handler->takePending(payload, queuedAt))
+			handler->invoke(*payload, queuedAt);
+	}
+	
+	static void invokePosted(const IntentTask & task) {
+		static_cast<PostedTask*>(task.mHandler.get())->run();
+	}
+};
+
+struct IntentTaskPriority {
+	inline size_t operator()(const IntentTask & task) const noexcept { return static_cast<size_t>(task.getPriority()); }
+};
+
+using IntentExecutionQueue = MultiLevelBlockingQueue<IntentTask, static_cast<size_t>(IntentPriority::CRITICAL) + 1, IntentTaskPriority>;
+
+class IntentWorkers;
+
+/**
+ * Serializes the tasks of a single subscriber when intents are executed on a worker pool. A strand is scheduled on at
+ * most one worker at a time, so each subscriber sees its intents one at a time and in broadcast order.
+ */
+class IntentStrand {
+	public:
+	/**
+	 * Queues the task behind any pending tasks of this subscriber
+	 * @param executor set to the strand's own executor, if it has one, when the strand must be scheduled
+	 * @return TRUE if the strand was idle and must now be scheduled, FALSE if it is already scheduled
+	 */
+	bool push(IntentTask && task, std::shared_ptr<IntentWorkers> & executor) {
+		std::lock_guard<std::mutex> lk(mLock);
+		mTasks.emplace_back(std::move(task));
+		if (mScheduled)
+			return false;
+		mScheduled = true;
+		executor = mExecutor;
+		return true;
+	}
+	
+	/**
+	 * Makes the strand run on its own executor rather than the IntentManager's, from the next time it is scheduled.
+	 * The executor can be replaced but not removed, so that a strand never goes back to a queue it was never drained from.
+	 */
+	void setExecutor(std::shared_ptr<IntentWorkers> executor) {
+		std::lock_guard<std::mutex> lk(mLock);
+		mExecutor = std::move(executor);
+		mHasExecutor.store(true, std::memory_order_seq_cst);
+	}
+	
+	[[nodiscard]] inline bool hasExecutor() const noexcept { return mHasExecutor.load(std::memory_order_acquire); }
+	
+	/**
+	 * Decides whether a task goes to run() in serial mode. Once an executor is set, tasks keep going to run() until
+	 * those already queued there have run, so that the subscriber never runs on both at once.
+	 * @return TRUE if the task must be queued for run(), counted until it runs by setQueuedIn(), FALSE if it must be
+	 *         pushed to this strand
+	 */
+	bool queueForRun() {
+		if (mOnExecutor.load(std::memory_order_acquire))
+			return false;
+		mQueuedForRun.fetch_add(1, std::memory_order_seq_cst);
+		if (!mHasExecutor.load(std::memory_order_seq_cst))
+			return true;
+		std::lock_guard<std::mutex> lk(mLock);
+		// Anyone that found no executor counted itself first, so only this task counting means run() has none left
+		if (!mOnExecutor.load(std::memory_order_relaxed) && mQueuedForRun.load(std::memory_order_seq_cst) > 1)
+			return true;
+		mOnExecutor.store(true, std::memory_order_release);
+		mQueuedForRun.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+	
+	inline void finishQueuedForRun() noexcept { mQueuedForRun.fetch_sub(1, std::memory_order_release); }
+	
+	/**
+	 * Runs up to maxTasks pending tasks in order
+	 * @return TRUE if tasks remain and the strand must be rescheduled, FALSE if the strand is now idle
+	 */
+	bool drain(size_t maxTasks) {
+		IntentTask task;
+		for (size_t i = 0; i < maxTasks; i++) {
+			{
+				std::lock_guard<std::mutex> lk(mLock);
+				if (mTasks.empty()) {
+					mScheduled = false;
+					return false;
+				}
+				task = std::move(mTasks.front());
+				mTasks.pop_front();
+			}
+			task();
+		}
+		std::lock_guard<std::mutex> lk(mLock);
+		if (mTasks.empty()) {
+			mScheduled = false;
+			return false;
+		}
+		return true;
+	}
+	
+	private:
+	std::mutex mLock;
+	std::deque<IntentTask> mTasks;
+	bool mScheduled{false};
+	std::shared_ptr<IntentWorkers> mExecutor;
+	std::atomic_bool mHasExecutor{false};
+	std::atomic_bool mOnExecutor{false};      // in serial mode, once run() no longer has any of its tasks
+	std::atomic_size_t mQueuedForRun{0};
+};
+
+inline void IntentTask::operator()() const {
+	mInvoke(*this);
+	if (mQueuedIn != nullptr)
+		mQueuedIn->finishQueuedForRun();
+}
+
+/**
+ * Worker pool task that drains one scheduled strand
+ */
+class IntentStrandTask {
+	public:
+	IntentStrandTask() noexcept = default;
+	IntentStrandTask(IntentWorkers * workers, std::shared_ptr<IntentStrand> strand) noexcept : mWorkers(workers), mStrand(std::move(strand)) { }
+	
+	inline void operator()();
+	
+	private:
+	IntentWorkers * mWorkers{nullptr};
+	std::shared_ptr<IntentStrand> mStrand;
+};
+
+/**
+ * The worker pool that executes strands in parallel mode
+ */
+class IntentWorkers {
+	public:
+	static constexpr size_t STRAND_BATCH = 16; // tasks run before a busy strand yields its worker
+	
+	explicit IntentWorkers(unsigned int nThreads, std::vector<int> cpus = {}) : mPool(nThreads) { mPool.setCpuAffinity(std::move(cpus)); }
+	~IntentWorkers() { mPool.stop(); }
+	
+	inline void start() { mPool.start(); }
+	inline void stop() { mPool.stop(); }
+	
+	void schedule(std::shared_ptr<IntentStrand> strand) {
+		{
+			std::lock_guard<std::mutex> lk(mLock);
+			mActiveStrands++;
+		}
+		mPool.execute(IntentStrandTask{this, std::move(strand)});
+	}
+	
+	/**
+	 * Blocks until every scheduled strand has run out of tasks
+	 */
+	void awaitIdle() {
+		std::unique_lock<std::mutex> lk(mLock);
+		mIdleCondition.wait(lk, [this]{ return mActiveStrands == 0; });
+	}
+	
+	private:
+	friend class IntentStrandTask;
+	
+	FifoThreadPool<IntentStrandTask> mPool;
+	std::mutex mLock;
+	std::condition_variable mIdleCondition;
+	size_t mActiveStrands{0};
+	
+	void onStrandDrained(IntentStrandTask && task, bool hasRemaining) {
+		if (hasRemaining) {
+			mPool.execute(std::move(task));
+			return;
+		}
+		std::lock_guard<std::mutex> lk(mLock);
+		if (--mActiveStrands == 0)
+			mIdleCondition.notify_all();
+	}
+};
+
+inline void IntentStrandTask::operator()() {
+	const bool hasRemaining = mStrand->drain(IntentWorkers::STRAND_BATCH);
+	mWorkers->onStrandDrained(std::move(*this), hasRemaining);
+}
+
+/**
+ * Maps intent slots to runners without locking. Entries are only written while holding the IntentManager's
+ * subscription lock, and are never removed, so a reader never sees a runner disappear.
+ */
+class IntentRunnerTable {
+	public:
+	static constexpr size_t CHUNK_SIZE = 64;
+	static constexpr size_t CHUNK_COUNT = 1024;
+	
+	IntentRunnerTable() = default;
+	IntentRunnerTable(const IntentRunnerTable &) = delete;
+	IntentRunnerTable & operator=(const IntentRunnerTable &) = delete;
+	~IntentRunnerTable() {
+		for (auto & chunk : mChunks)
+			delete chunk.load(std::memory_order_relaxed);
+	}
+	
+	[[nodiscard]] inline GenericIntentRunner * get(size_t slot) const noexcept {
+		if (slot >= CHUNK_SIZE * CHUNK_COUNT)
+			return nullptr;
+		auto chunk = mChunks[slot / CHUNK_SIZE].load(std::memory_order_acquire);
+		if (chunk == nullptr)
+			return nullptr;
+		return (*chunk)[slot % CHUNK_SIZE].load(std::memory_order_acquire);
+	}
+	
+	/**
+	 * Publishes the runner for the slot. Writers must be serialized by the caller.
+	 * @return FALSE if the slot exceeds the capacity of the table
+	 */
+	bool set(size_t slot, GenericIntentRunner * runner) {
+		if (slot >= CHUNK_SIZE * CHUNK_COUNT)
+			return false;
+		auto & chunkPtr = mChunks[slot / CHUNK_SIZE];
+		auto chunk = chunkPtr.load(std::memory_order_relaxed);
+		if (chunk == nullptr) {
+			chunk = new Chunk{};
+			chunkPtr.store(chunk, std::memory_order_release);
+		}
+		(*chunk)[slot % CHUNK_SIZE].store(runner, std::memory_order_release);
+		return true;
+	}
+	
+	private:
+	using Chunk = std::array<std::atomic<GenericIntentRunner*>, CHUNK_SIZE>;
+	std::array<std::atomic<Chunk*>, CHUNK_COUNT> mChunks{};
+};
+
+/**
+ * Epoch-based reclamation of what broadcasts read without locking. A reader publishes the current epoch for its thread
+ * while it holds a ReadGuard; a writer that replaces something retires the old version with advance(), and frees it
+ * once canReclaim() shows that no guard taken up to that epoch is still held. Readers never wait and never write
+ * shared state, while writers scan the reading threads.
+ */
+class IntentEpochs {
+	struct Slot {
+		std::atomic_uint64_t epoch{0}; // 0 outside of any guard
+		uint32_t depth{0};
+	};
+	
+	public:
+	class ReadGuard {
+		public:
+		ReadGuard() noexcept : mSlot(threadSlot()) {
+			if (mSlot.depth++ == 0) // nested broadcasts are covered by the outer, older epoch
+				mSlot.epoch.store(registry().epoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+		}
+		~ReadGuard() {
+			if (--mSlot.depth == 0)
+				mSlot.epoch.store(0, std::memory_order_release);
+		}
+		ReadGuard(const ReadGuard &) = delete;
+		ReadGuard & operator=(const ReadGuard &) = delete;
+		
+		private:
+		Slot & mSlot;
+	};
+	
+	/**
+	 * Starts a new epoch, after a writer unpublished something that readers may still hold
+	 * @return the epoch to retire it with
+	 */
+	static uint64_t advance() noexcept {
+		return registry().epoch.fetch_add(1, std::memory_order_seq_cst);
+	}
+	
+	/**
+	 * Returns TRUE once no reader can still hold what was retired at the epoch
+	 */
+	static bool canReclaim(uint64_t retiredAt) {
+		auto & reg = registry();
+		std::lock_guard<std::mutex> lk(reg.lock);
+		for (auto slot : reg.slots) {
+			const uint64_t epoch = slot->epoch.load(std::memory_order_seq_cst);
+			if (epoch != 0 && epoch <= retiredAt)
+				return false;
+		}
+		return true;
+	}
+	
+	private:
+	struct Registry {
+		std::mutex lock;
+		std::vector<Slot *> slots;
+		std::atomic_uint64_t epoch{1};
+	};
+	
+	struct ThreadSlot {
+		Slot slot;
+		ThreadSlot() {
+			auto & reg = registry();
+			std::lock_guard<std::mutex> lk(reg.lock);
+			reg.slots.push_back(&slot);
+		}
+		~ThreadSlot() {
+			auto & reg = registry();
+			std::lock_guard<std::mutex> lk(reg.lock);
+			reg.slots.erase(std::find(reg.slots.begin(), reg.slots.end(), &slot));
+		}
+	};
+	
+	static Registry & registry() noexcept {
+		static auto * reg = new Registry(); // never destroyed, so threads exiting after main() can still leave it
+		return *reg;
+	}
+	
+	static Slot & threadSlot() noexcept {
+		thread_local ThreadSlot slot;
+		return slot.slot;
+	}
 };
 
 } // namespace IntentManagerHelper
 
+/**
+ * Kept for source compatibility: intents are now queued as IntentManagerHelper::IntentTask
+ */
+using IntentCallbackCompiled = std::function<void()>;
+
 template<typename T>
 class IntentRunner : public IntentManagerHelper::GenericIntentRunner {
 	public:
+	using HandlerList = std::vector<std::shared_ptr<IntentManagerHelper::IntentHandler<T>>>;
 	
-	inline void subscribe(std::string && name, const IntentCallback<T> && handler) noexcept {
-		mHandlers.emplace_back(std::make_shared<IntentManagerHelper::IntentHandler<T>>(std::move(handler), std::move(name)));
-	}
-	
-	inline unsigned int broadcast(LinkedBlockingQueue<IntentCallbackCompiled> & executionQueue, const T & arg) noexcept {
-		unsigned int handlerCount = 0;
-		for (auto & f : mHandlers) {
-			executionQueue.add([f, arg]() {
-				try {
-					auto begin = std::chrono::high_resolution_clock::now();
-					(*f)(std::move(arg));
-					auto end = std::chrono::high_resolution_clock::now();
-					f->addTime(std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count());
-				} catch (const std::exception &e) {
-					Log::error("Exception thrown when handling %s in %s. %s", typeid(T).name(), f->name.c_str(), e.what());
-				} catch (const std::string &s) {
-					Log::error("Exception thrown when handling %s in %s. %s", typeid(T).name(), f->name.c_str(), s.c_str());
-				} catch (const char *s) {
-					Log::error("Exception thrown when handling %s in %s. %s", typeid(T).name(), f->name.c_str(), s);
-				} catch (...) {
-					Log::error("Exception thrown when handling %s in %s. Unknown Error.", typeid(T).name(), f->name.c_str());
-				}
-			});
-			handlerCount++;
+	/*
+	 * Subscriptions are copy-on-write: writers publish a new handler list and broadcasts keep iterating whichever
+	 * immutable list they loaded, protected by an IntentEpochs::ReadGuard, until the replaced list can be freed. Writers,
+	 * and every method other than broadcasting, must be serialized by the caller.
+	 */
+	
+	IntentRunner() = default;
+	IntentRunner(const IntentRunner &) = delete;
+	IntentRunner & operator=(const IntentRunner &) = delete;
+	~IntentRunner() override {
+		delete mHandlers.load(std::memory_order_relaxed);
+		for (auto & retired : mRetired)
+			delete retired.second;
+	}
+	
+	inline void subscribe(uint64_t id, std::string && name, const IntentCallback<T> && handler, std::shared_ptr<IntentManagerHelper::IntentStrand> strand, std::shared_ptr<ResourceAccount> account, bool inlineDispatch, int priority) noexcept {
+		auto f = std::make_shared<IntentManagerHelper::IntentHandler<T>>(id, std::move(handler), std::move(name), std::move(strand), std::move(account), inlineDispatch, priority);
+		f->setTimingInterval(mTimingInterval);
+		f->setResourceAccounting(mAccounting);
+		f->setQueueLimit(mMaxPending, mOverflowPolicy);
+		auto handlers = std::make_unique<HandlerList>(getHandlers());
+		handlers->emplace_back(std::move(f));
+		publish(handlers.release());
+	}
+	
+	bool unsubscribe(uint64_t id) override {
+		const HandlerList & current = getHandlers();
+		auto handlers = std::make_unique<HandlerList>();
+		handlers->reserve(current.size());
+		bool removed = false;
+		for (auto & f : current) {
+			if (f->id == id) {
+				f->cancel();
+				removed = true;
+			} else {
+				handlers->emplace_back(f);
+			}
+		}
+		if (removed)
+			publish(handlers.release());
+		return removed;
+	}
+	
+	void setTimingInterval(uint32_t interval) override {
+		mTimingInterval = interval;
+		for (auto & f : getHandlers()) {
+			f->setTimingInterval(interval);
+		}
+	}
+	
+	void setResourceAccounting(bool accounting) override {
+		mAccounting = accounting;
+		for (auto & f : getHandlers()) {
+			f->setResourceAccounting(accounting);
 		}
-		return handlerCount;
+	}
+	
+	/**
+	 * Limits the pending intents of every subscriber that does not have its own limit
+	 * @param maxPending 0 for no limit
+	 */
+	void setQueueLimit(size_t maxPending, IntentOverflowPolicy policy) {
+		mMaxPending = maxPending;
+		mOverflowPolicy = policy;
+		for (auto & f : getHandlers()) {
+			if (!f->hasOwnQueueLimit)
+				f->setQueueLimit(maxPending, policy);
+		}
+		updateRejecting();
+	}
+	
+	/**
+	 * Limits the pending intents of every subscription with the given name
+	 * @return TRUE if there was at least one
+	 */
+	bool setQueueLimit(const std::string & subscriber, size_t maxPending, IntentOverflowPolicy policy) {
+		bool found = false;
+		for (auto & f : getHandlers()) {
+			if (f->name == subscriber) {
+				f->hasOwnQueueLimit = true;
+				f->setQueueLimit(maxPending, policy);
+				found = true;
+			}
+		}
+		updateRejecting();
+		return found;
+	}
+	
+	void getIntentQueueStats(std::vector<IntentQueueStats> & stats) override {
+		for (auto & f : getHandlers()) {
+			if (!f->inlineDispatch)
+				stats.emplace_back(f->getQueueStats());
+		}
+	}
+	
+	/**
+	 * Sets the priority of every subscription that did not request its own
+	 */
+	inline void setPriority(IntentPriority priority) noexcept {
+		mPriority = priority;
+	}
+	
+	template<typename U, typename Dispatch>
+	inline IntentBroadcastResult broadcast(U && arg, const Dispatch & dispatch) noexcept {
+		std::shared_ptr<const T> payload;
+		return dispatchAll(&arg, payload, [&arg]() { return std::make_shared<T>(std::forward<U>(arg)); }, dispatch);
+	}
+	
+	/**
+	 * Broadcasts a payload that is already shared, such as one acquired from an IntentPool, without copying it
+	 */
+	template<typename Dispatch>
+	inline IntentBroadcastResult broadcastShared(std::shared_ptr<const T> payload, const Dispatch & dispatch) noexcept {
+		const T * value = payload.get();
+		return dispatchAll(value, payload, []() { return std::shared_ptr<T>(); }, dispatch);
 	}
 	
 	std::map<std::pair<std::string, std::string>, uint64_t> getIntentTiming() override {
 		std::map<std::pair<std::string, std::string>, uint64_t> ret;
 		auto type = std::string(typeid(T).name());
-		for (auto & f : mHandlers) {
+		for (auto & f : getHandlers()) {
 			ret[std::make_pair(type, f->name)] = f->getAverageTimeNanoseconds();
 		}
 		return ret;
 	}
 	
+	void getIntentTimingSnapshot(std::vector<IntentTimingSnapshot> & snapshots) override {
+		for (auto & f : getHandlers()) {
+			snapshots.emplace_back(f->getTimingSnapshot());
+		}
+	}
+	
+	private:
+	std::atomic<const HandlerList *> mHandlers{new HandlerList()};
+	std::vector<std::pair<uint64_t, const HandlerList *>> mRetired; // replaced lists, with the epoch they were retired at
+	std::atomic_size_t mMaxPending{0};
+	std::atomic<IntentOverflowPolicy> mOverflowPolicy{IntentOverflowPolicy::DROP_NEWEST};
+	std::atomic_bool mRejecting{false};
+	std::atomic<IntentPriority> mPriority{IntentPriority::NORMAL};
+	std::atomic_uint32_t mTimingInterval{1};
+	std::atomic_bool mAccounting{false};
+	
+	/**
+	 * Returns the current list, which only writers replace and free
+	 */
+	[[nodiscard]] inline const HandlerList & getHandlers() const noexcept {
+		return *mHandlers.load(std::memory_order_acquire);
+	}
+	
+	void publish(const HandlerList * handlers) {
+		const HandlerList * replaced = mHandlers.exchange(handlers, std::memory_order_seq_cst);
+		mRetired.emplace_back(IntentManagerHelper::IntentEpochs::advance(), replaced);
+		mRetired.erase(std::remove_if(mRetired.begin(), mRetired.end(), [](const auto & retired) {
+			if (!IntentManagerHelper::IntentEpochs::canReclaim(retired.first))
+				return false;
+			delete retired.second;
+			return true;
+		}), mRetired.end());
+		updateRejecting();
+	}
+	
+	/**
+	 * Tracks whether any subscriber can reject broadcasts, so that the others don't pay for the extra check
+	 */
+	inline void updateRejecting() noexcept {
+		bool rejecting = false;
+		for (auto & f : getHandlers()) {
+			if (f->isLimited() && f->getOverflowPolicy() == IntentOverflowPolicy::REJECT)
+				rejecting = true;
+		}
+		mRejecting = rejecting;
+	}
+	
+	/**
+	 * Runs inline handlers immediately and dispatches a task for every other handler, or offers the intent to the
+	 * mailbox of subscribers with a queue limit. If no payload is shared yet, makePayload creates it once the first
+	 * queued handler needs it, so types with only inline subscribers never allocate.
+	 */
+	template<typename MakePayload, typename Dispatch>
+	inline IntentBroadcastResult dispatchAll(const T * value, std::shared_ptr<const T> & payload, const MakePayload & makePayload, const Dispatch & dispatch) noexcept {
+		IntentBroadcastResult result;
+		const IntentPriority typePriority = mPriority;
+#ifndef JLCOMMON_DISABLE_INTENT_TIMING
+		// Only sampled broadcasts read the clock; the others leave the epoch, which tells handlers not to record the wait
+		const bool sampled = IntentManagerHelper::shouldSampleTiming(mTimingInterval.load(std::memory_order_relaxed), IntentManagerHelper::broadcastSampler);
+		const auto queuedAt = sampled ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+#else
+		const auto queuedAt = std::chrono::steady_clock::time_point{};
+#endif
+		IntentManagerHelper::IntentEpochs::ReadGuard guard;
+		const HandlerList & handlers = *mHandlers.load(std::memory_order_seq_cst);
+		if (mRejecting.load(std::memory_order_relaxed)) {
+			for (auto & f : handlers) {
+				if (!f->inlineDispatch && f->isRejecting()) {
+					f->countRejected();
+					result.rejected = true;
+					return result;
+				}
+			}
+		}
+		for (auto & f : handlers) {
+			if (f->inlineDispatch) {
+				f->invoke(*value, queuedAt);
+				result.handlers++;
+				continue;
+			}
+			if (!payload) {
+				payload = makePayload();
+				value = payload.get();
+			}
+			const auto priority = (f->priority < 0) ? typePriority : static_cast<IntentPriority>(f->priority);
+			if (!f->isLimited()) {
+				dispatch(IntentManagerHelper::IntentTask{f, payload, queuedAt, priority}, f->strand);
+				result.handlers++;
+				continue;
+			}
+			bool blocked = false;
+			switch (f->offer(payload, queuedAt, blocked)) {
+				case IntentManagerHelper::IntentHandler<T>::Offer::QUEUED:
+					dispatch(IntentManagerHelper::IntentTask{f, queuedAt, priority}, f->strand);
+					result.handlers++;
+					break;
+				case IntentManagerHelper::IntentHandler<T>::Offer::REPLACED:
+					result.handlers++;
+					result.dropped++;
+					break;
+				case IntentManagerHelper::IntentHandler<T>::Offer::DROPPED:
+					result.dropped++;
+					break;
+				case IntentManagerHelper::IntentHandler<T>::Offer::CANCELLED:
+					break;
+			}
+			if (blocked)
+				result.blocked++;
+		}
+		return result;
+	}
+
+};
+
+/**
+ * Threads dedicated to the subscribers assigned to them with IntentManager::setExecutor(), so that a heavy subscriber
+ * cannot delay the others. Each subscriber still runs one handler or task at a time, in the order they were queued.
+ */
+class IntentExecutor {
+	public:
+	/**
+	 * @param cpus if not empty, worker i is pinned to cpus[i % cpus.size()]
+	 */
+	explicit IntentExecutor(unsigned int threads, std::vector<int> cpus = {}) :
+			mWorkers(std::make_shared<IntentManagerHelper::IntentWorkers>((threads == 0) ? 1 : threads, std::move(cpus))) {
+		mWorkers->start();
+	}
+	
+	/**
+	 * Creates a single thread for one subscriber, pinned to the CPU unless it is negative
+	 */
+	static std::shared_ptr<IntentExecutor> createDedicated(int cpu = -1) {
+		return std::make_shared<IntentExecutor>(1, (cpu < 0) ? std::vector<int>{} : std::vector<int>{cpu});
+	}
+	
+	/**
+	 * Creates a pool to be shared by several subscribers, away from the IntentManager's own execution
+	 */
+	static std::shared_ptr<IntentExecutor> createPool(unsigned int threads, std::vector<int> cpus = {}) {
+		return std::make_shared<IntentExecutor>(threads, std::move(cpus));
+	}
+	
+	private:
+	friend class IntentManager;
+	
+	const std::shared_ptr<IntentManagerHelper::IntentWorkers> mWorkers;
+};
+
+/**
+ * Handle to a callback scheduled with IntentManager::schedule() or scheduleAtFixedRate()
+ */
+class ScheduledTask {
+	public:
+	ScheduledTask() noexcept = default;
+	
+	/**
+	 * Prevents any further run. A run that is already queued or in progress is not interrupted.
+	 */
+	inline void cancel() noexcept {
+		if (mState)
+			mState->cancelled.store(true, std::memory_order_release);
+	}
+	
+	[[nodiscard]] inline bool isValid() const noexcept { return static_cast<bool>(mState); }
+	
 	private:
-	std::vector<std::shared_ptr<IntentManagerHelper::IntentHandler<T>>> mHandlers;
+	friend class IntentManager;
 	
+	struct State {
+		std::string name;
+		std::function<void()> task;
+		std::chrono::steady_clock::time_point next;
+		std::chrono::milliseconds period; // zero to run once
+		std::atomic_bool cancelled{false};
+	};
+	
+	std::shared_ptr<State> mState;
+	
+	explicit ScheduledTask(std::shared_ptr<State> state) noexcept : mState(std::move(state)) { }
 };
 
 class IntentManager {
 	private:
 	template<typename T>
-	inline void internalSubscribe(std::string && name, const IntentCallback<T> && handler) noexcept {
-		for (auto & runners : mHandlers) {
-			if (runners.first == typeid(T)) {
-				reinterpret_cast<IntentRunner<T>*>(runners.second.get())->subscribe(std::move(name), std::move(handler));
-				return;
-			}
+	[[nodiscard]] inline IntentRunner<T> * getRunner() const noexcept {
+		return static_cast<IntentRunner<T>*>(mRunnerTable.get(IntentManagerHelper::getIntentSlot<T>()));
+	}
+	
+	/**
+	 * Returns the runner for the intent type, creating it if necessary. Requires mSubscriptionLock.
+	 */
+	template<typename T>
+	inline IntentRunner<T> * getOrCreateRunner() {
+		auto runner = getRunner<T>();
+		if (runner != nullptr)
+			return runner;
+		auto created = std::make_shared<IntentRunner<T>>();
+		created->setTimingInterval(mTimingInterval);
+		created->setResourceAccounting(mAccounting);
+		if (!mRunnerTable.set(IntentManagerHelper::getIntentSlot<T>(), created.get())) {
+			Log::error("Too many intent types to register %s", typeid(T).name());
+			return nullptr;
 		}
-		auto runner = std::make_shared<IntentRunner<T>>();
-		mHandlers.emplace_back(typeid(T), runner);
-		runner->subscribe(std::move(name), std::move(handler));
+		mRunners.emplace_back(created);
+		return created.get();
+	}
+	
+	template<typename T>
+	inline IntentSubscription internalSubscribe(std::string && name, const IntentCallback<T> && handler, bool inlineDispatch, int priority, std::shared_ptr<ResourceAccount> account = nullptr) noexcept {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		auto runner = getOrCreateRunner<T>();
+		if (runner == nullptr)
+			return IntentSubscription{};
+		auto strand = (name == ANONYMOUS) ? std::make_shared<IntentManagerHelper::IntentStrand>() : getOrCreateStrand(name);
+		if (!account) {
+			auto & named = mAccounts[name];
+			if (!named)
+				named = std::make_shared<ResourceAccount>();
+			account = named;
+		}
+		const auto subscription = IntentSubscription{IntentManagerHelper::getIntentSlot<T>(), mNextSubscriptionId++};
+		runner->subscribe(subscription.id, std::move(name), std::move(handler), strand, account, inlineDispatch, priority);
+		return subscription;
+	}
+	
+	static constexpr const char * ANONYMOUS = "N/A";
+	
+	/**
+	 * Returns the strand of the subscriber name, creating it if necessary. Requires mSubscriptionLock.
+	 */
+	inline std::shared_ptr<IntentManagerHelper::IntentStrand> getOrCreateStrand(const std::string & name) {
+		auto & strand = mStrands[name];
+		if (!strand)
+			strand = std::make_shared<IntentManagerHelper::IntentStrand>();
+		return strand;
+	}
+	
+	inline void dispatch(IntentManagerHelper::IntentTask && task, const std::shared_ptr<IntentManagerHelper::IntentStrand> & strand) noexcept {
+		if (!mWorkers && strand->queueForRun()) {
+			task.setQueuedIn(strand.get());
+			mExecutionQueue.add(std::move(task));
+			return;
+		}
+		std::shared_ptr<IntentManagerHelper::IntentWorkers> executor;
+		if (strand->push(std::move(task), executor)) {
+			if (executor)
+				executor->schedule(strand);
+			else
+				mWorkers->schedule(strand);
+		}
+	}
+	
+	/**
+	 * Queues the next run of a scheduled task on the scheduler thread, which posts it to the subscriber when due
+	 */
+	void arm(const std::shared_ptr<ScheduledTask::State> & state) {
+		const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(state->next - std::chrono::steady_clock::now());
+		const unsigned long delay = (remaining.count() > 0) ? static_cast<unsigned long>(remaining.count()) : 0;
+		std::lock_guard<std::mutex> lk(mSchedulerLock);
+		if (!mScheduler) {
+			mScheduler = std::make_unique<ScheduledThreadPool<std::function<void()>>>(1);
+			if (mRunning)
+				mScheduler->start();
+		}
+		mScheduler->execute(delay, [this, state] {
+			if (state->cancelled.load(std::memory_order_acquire))
+				return;
+			post(state->name, [this, state] {
+				if (state->cancelled.load(std::memory_order_acquire))
+					return;
+				if (state->period.count() > 0) {
+					state->next += state->period;
+					arm(state);
+				}
+				state->task();
+			});
+		});
 	}
 	
 	public:
 	IntentManager() = default;
-
+	
+	~IntentManager() {
+		// Every thread that may run a task referencing this manager stops before any member is destroyed
+		{
+			std::lock_guard<std::mutex> lk(mSchedulerLock);
+			if (mScheduler)
+				mScheduler->stop();
+		}
+		if (mWorkers)
+			mWorkers->stop();
+		// Executors may outlive this manager, so let them finish tasks that reference it
+		for (auto & executor : mExecutors)
+			executor->awaitIdle();
+	}
+	
+	/**
+	 * Creates an IntentManager in parallel mode, where intents fan out across a pool of worker threads instead of waiting
+	 * for run(). Every subscriber name gets its own strand, so a service never runs two of its handlers concurrently
+	 * and sees its intents in broadcast order, while independent services run on different threads.
+	 */
+	explicit IntentManager(unsigned int workerThreads) {
+		if (workerThreads > 0) {
+			mWorkers = std::make_unique<IntentManagerHelper::IntentWorkers>(workerThreads);
+			mWorkers->start();
+		}
+	}
+	
+	/*
+	 * Subscribing and unsubscribing are safe from any thread, at any time. Broadcasts read the subscriptions without
+	 * locking and never wait on them; only queueing intents for other threads may take a lock.
+	 */
+	
 	template<typename T>
-	void subscribe(std::string name, const IntentCallback<T> handler) noexcept {
-		internalSubscribe(std::move(name), std::move(handler));
+	IntentSubscription subscribe(std::string name, const IntentCallback<T> handler) noexcept {
+		return internalSubscribe(std::move(name), std::move(handler), false, -1);
 	}
 	
+	/**
+	 * Subscribes without a name. Each anonymous subscription gets a strand of its own, so in parallel mode anonymous
+	 * handlers run concurrently with each other, unlike the handlers sharing a name.
+	 */
 	template<typename T>
-	void subscribe(const IntentCallback<T> handler) noexcept {
-		internalSubscribe(std::string("N/A"), std::move(handler));
+	IntentSubscription subscribe(const IntentCallback<T> handler) noexcept {
+		return internalSubscribe(std::string(ANONYMOUS), std::move(handler), false, -1);
 	}
 	
+	/**
+	 * Subscribes a handler whose intents are queued with the given priority, instead of the intent type's priority
+	 */
 	template<typename T>
-	unsigned int broadcast(T && arg) noexcept {
-		for (auto & runners : mHandlers) {
-			if (runners.first == typeid(T)) {
-				return reinterpret_cast<IntentRunner<T>*>(runners.second.get())->broadcast(mExecutionQueue, std::forward<T>(arg));
-			}
+	IntentSubscription subscribe(std::string name, const IntentCallback<T> handler, IntentPriority priority) noexcept {
+		return internalSubscribe(std::move(name), std::move(handler), false, static_cast<int>(priority));
+	}
+	
+	/**
+	 * Subscribes a handler that charges the given account, e.g. the one owned by a Service, instead of the account
+	 * shared by every subscription with the same name
+	 */
+	template<typename T>
+	IntentSubscription subscribe(std::string name, const IntentCallback<T> handler, std::shared_ptr<ResourceAccount> account) noexcept {
+		return internalSubscribe(std::move(name), std::move(handler), false, -1, std::move(account));
+	}
+	
+	/**
+	 * Subscribes a handler that runs synchronously on the broadcasting thread, inside broadcast(), with the same
+	 * exception handling and timing as queued handlers. Only suitable for cheap, thread-safe handlers.
+	 */
+	template<typename T>
+	IntentSubscription subscribeInline(std::string name, const IntentCallback<T> handler) noexcept {
+		return internalSubscribe(std::move(name), std::move(handler), true, -1);
+	}
+	
+	template<typename T>
+	IntentSubscription subscribeInline(std::string name, const IntentCallback<T> handler, std::shared_ptr<ResourceAccount> account) noexcept {
+		return internalSubscribe(std::move(name), std::move(handler), true, -1, std::move(account));
+	}
+	
+	/**
+	 * Removes the subscription. Once this returns, the handler will not be started again, although an invocation that
+	 * already started on another thread may still be running.
+	 * @return TRUE if the subscription was found and removed
+	 */
+	bool unsubscribe(const IntentSubscription & subscription) noexcept {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		auto runner = mRunnerTable.get(subscription.slot);
+		return subscription.isValid() && runner != nullptr && runner->unsubscribe(subscription.id);
+	}
+	
+	/**
+	 * Configures how handlers are timed, for every current and future subscription. FULL is the default.
+	 * @param sampleInterval for SAMPLED, the average number of invocations per measured one. Queue waits are sampled
+	 *        separately, on about one in sampleInterval broadcasts, since only those read the clock, and recorded by
+	 *        every queued handler of a sampled broadcast.
+	 */
+	void setIntentTiming(IntentTimingMode mode, uint32_t sampleInterval = 64) {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		switch (mode) {
+			case IntentTimingMode::OFF:
+				mTimingInterval = 0;
+				break;
+			case IntentTimingMode::FULL:
+				mTimingInterval = 1;
+				break;
+			case IntentTimingMode::SAMPLED:
+				mTimingInterval = (sampleInterval == 0) ? 1 : sampleInterval;
+				break;
+		}
+		for (auto & runner : mRunners) {
+			runner->setTimingInterval(mTimingInterval);
+		}
+	}
+	
+	/**
+	 * Charges the CPU time and number of invocations of every handler to the ResourceAccount of its subscriber name.
+	 * Off by default, since reading the thread CPU clock costs a system call on most platforms.
+	 */
+	void setResourceAccounting(bool accounting) {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		mAccounting = accounting;
+		for (auto & runner : mRunners) {
+			runner->setResourceAccounting(accounting);
+		}
+	}
+	
+	/**
+	 * Makes future subscriptions with this name charge the given account, unless they were given their own
+	 */
+	void setResourceAccount(const std::string & name, std::shared_ptr<ResourceAccount> account) {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		mAccounts[name] = std::move(account);
+	}
+	
+	/**
+	 * Returns the account charged by subscriptions with this name, creating it if needed
+	 */
+	std::shared_ptr<ResourceAccount> getResourceAccount(const std::string & name) {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		auto & account = mAccounts[name];
+		if (!account)
+			account = std::make_shared<ResourceAccount>();
+		return account;
+	}
+	
+	/**
+	 * Marks the intent type as a "latest value" update. Each subscriber then has at most one pending delivery of it,
+	 * always carrying the most recently broadcast value, so stale copies never pile up behind a slow consumer. This is
+	 * a queue limit of one with the DROP_OLDEST policy, and replaces any other limit on the type.
+	 */
+	template<typename T>
+	void setCoalescing(bool coalescing) {
+		if (coalescing)
+			setQueueLimit<T>(1, IntentOverflowPolicy::DROP_OLDEST);
+		else
+			setQueueLimit<T>(0, IntentOverflowPolicy::DROP_OLDEST);
+	}
+	
+	/**
+	 * Bounds the number of intents of this type that may be waiting for each subscriber, so that a flood of one type
+	 * cannot fill the execution queue. Subscribers given their own limit keep it.
+	 *
+	 * With the BLOCK policy, broadcasting from the thread that calls run() deadlocks once a subscriber is full.
+	 * @param maxPending 0 to remove the limit
+	 */
+	template<typename T>
+	void setQueueLimit(size_t maxPending, IntentOverflowPolicy policy) {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		auto runner = getOrCreateRunner<T>();
+		if (runner != nullptr)
+			runner->setQueueLimit(maxPending, policy);
+	}
+	
+	/**
+	 * Bounds the number of intents of this type that may be waiting for the existing subscriptions of one subscriber
+	 * @param maxPending 0 to remove the limit
+	 * @return TRUE if the subscriber was subscribed to the type
+	 */
+	template<typename T>
+	bool setQueueLimit(const std::string & subscriber, size_t maxPending, IntentOverflowPolicy policy) {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		auto runner = getRunner<T>();
+		return runner != nullptr && runner->setQueueLimit(subscriber, maxPending, policy);
+	}
+	
+	/**
+	 * Sets the execution priority of the intent type, for subscriptions that did not request their own. In parallel
+	 * mode priorities do not reorder a subscriber's strand, which always runs in broadcast order.
+	 */
+	template<typename T>
+	void setPriority(IntentPriority priority) {
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		auto runner = getOrCreateRunner<T>();
+		if (runner != nullptr)
+			runner->setPriority(priority);
+	}
+	
+	/**
+	 * Broadcasts an intent that is already held in a shared_ptr, e.g. one acquired from an IntentPool, without copying
+	 * or moving it. The instance must not be modified until every subscriber is done with it.
+	 */
+	template<typename T>
+	IntentBroadcastResult broadcastShared(std::shared_ptr<T> payload) noexcept {
+		using Intent = std::remove_const_t<T>;
+		auto runner = getRunner<Intent>();
+		if (runner != nullptr && payload)
+			return runner->broadcastShared(std::shared_ptr<const Intent>(std::move(payload)), [this](IntentManagerHelper::IntentTask && task, const auto & strand) { dispatch(std::move(task), strand); });
+		return IntentBroadcastResult{};
+	}
+	
+	/**
+	 * Delivers the intent to every subscriber of its type
+	 * @return the outcome, which converts to the number of subscribers that ran or queued the intent
+	 */
+	template<typename T>
+	IntentBroadcastResult broadcast(T && arg) noexcept {
+		using Intent = std::decay_t<T>;
+		auto runner = getRunner<Intent>();
+		if (runner != nullptr) {
+			const auto result = runner->broadcast(std::forward<T>(arg), [this](IntentManagerHelper::IntentTask && task, const auto & strand) { dispatch(std::move(task), strand); });
+			if (result.handlers > 0 || result.rejected || result.dropped > 0)
+				return result;
 		}
 #ifdef DEBUG_INTENT_MANAGER_NO_SUBSCRIBERS
 		Log::warn("No matching subscribers for intent type: %s", typeid(T).name());
 #endif
-		return 0;
+		return IntentBroadcastResult{};
+	}
+	
+	/**
+	 * Runs the handlers and tasks of every subscription with this name on the executor, instead of run() or the workers
+	 * of parallel mode. Applies to existing and future subscriptions, from their next queued intent on, except that in
+	 * serial mode the subscriber keeps queueing for run() until what it already queued there has run. A subscriber
+	 * can be moved to another executor, but not back to the default.
+	 */
+	void setExecutor(const std::string & name, std::shared_ptr<IntentExecutor> executor) {
+		if (!executor)
+			return;
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		getOrCreateStrand(name)->setExecutor(executor->mWorkers);
+		if (std::find(mExecutors.begin(), mExecutors.end(), executor->mWorkers) == mExecutors.end())
+			mExecutors.emplace_back(executor->mWorkers); // kept alive for as long as a strand may still be scheduled on it
+	}
+	
+	/**
+	 * Queues a task behind the pending intents of the subscriber, so that it runs wherever the subscriber's handlers
+	 * run and never concurrently with them. Exceptions thrown by the task are logged.
+	 */
+	void post(const std::string & name, std::function<void()> task, IntentPriority priority = IntentPriority::NORMAL) {
+		std::shared_ptr<IntentManagerHelper::IntentStrand> strand;
+		{
+			std::lock_guard<std::mutex> lk(mSubscriptionLock);
+			strand = getOrCreateStrand(name);
+		}
+		dispatch(IntentManagerHelper::IntentTask{std::make_shared<IntentManagerHelper::PostedTask>(name, std::move(task)), priority}, strand);
 	}
 	
+	/**
+	 * Posts the task to the subscriber once the delay has passed. Timing is kept by a single scheduler thread, created
+	 * on first use, and the task itself runs like any other posted task.
+	 */
+	ScheduledTask schedule(const std::string & name, std::chrono::milliseconds delay, std::function<void()> task) {
+		return scheduleAtFixedRate(name, delay, std::chrono::milliseconds(0), std::move(task));
+	}
+	
+	/**
+	 * Posts the task to the subscriber after the initial delay and then every period, measured from when each run
+	 * was due, until cancelled. A run that falls behind delays the next one rather than overlapping it.
+	 */
+	ScheduledTask scheduleAtFixedRate(const std::string & name, std::chrono::milliseconds initialDelay, std::chrono::milliseconds period, std::function<void()> task) {
+		auto state = std::make_shared<ScheduledTask::State>();
+		state->name = name;
+		state->task = std::move(task);
+		state->next = std::chrono::steady_clock::now() + initialDelay;
+		state->period = period;
+		arm(state);
+		return ScheduledTask{std::move(state)};
+	}
+	
+	/**
+	 * Runs all queued intents on the calling thread. In parallel mode, or for subscribers on their own executor, this
+	 * also blocks until those workers are idle. Does nothing once stopped, since stopped workers never become idle.
+	 */
 	void runUntilEmpty() {
-		IntentCallbackCompiled operation;
+		if (!mRunning)
+			return;
+		IntentManagerHelper::IntentTask operation;
 		while (!mExecutionQueue.empty()) {
 			if (mExecutionQueue.poll(operation)) {
 				operation();
 			}
 		}
+		if (mWorkers)
+			mWorkers->awaitIdle();
+		std::vector<std::shared_ptr<IntentManagerHelper::IntentWorkers>> executors;
+		{
+			std::lock_guard<std::mutex> lk(mSubscriptionLock);
+			executors = mExecutors;
+		}
+		for (auto & executor : executors)
+			executor->awaitIdle();
 	}
 	
 	bool run() {
-		IntentCallbackCompiled operation;
+		IntentManagerHelper::IntentTask operation;
 		if (mExecutionQueue.take(operation, [this](){return !static_cast<bool>(mRunning);})) {
 			operation();
 			return true;
@@ -173,47 +1523,92 @@ class IntentManager {
 	
 	void start() {
 		mRunning = true;
+		if (mWorkers)
+			mWorkers->start();
+		std::lock_guard<std::mutex> lk(mSchedulerLock);
+		if (mScheduler)
+			mScheduler->start();
 	}
 	
+	/**
+	 * Stops run() and the workers of parallel mode, and pauses scheduled tasks. Executors keep running, since they may
+	 * be shared with other IntentManagers.
+	 */
 	void stop() {
 		mRunning = false;
 		mExecutionQueue.interruptBlocking();
+		if (mWorkers)
+			mWorkers->stop();
+		std::lock_guard<std::mutex> lk(mSchedulerLock);
+		if (mScheduler)
+			mScheduler->stop();
+	}
+	
+	/**
+	 * Returns the run time and queue wait distributions of every handler
+	 */
+	[[nodiscard]] std::vector<IntentTimingSnapshot> getIntentTimingSnapshot() const {
+		std::vector<IntentTimingSnapshot> snapshots;
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		for (auto & runner : mRunners) {
+			runner->getIntentTimingSnapshot(snapshots);
+		}
+		return snapshots;
+	}
+	
+	/**
+	 * Returns the queue limit and load shedding counters of every queued subscription
+	 */
+	[[nodiscard]] std::vector<IntentQueueStats> getIntentQueueStats() const {
+		std::vector<IntentQueueStats> stats;
+		std::lock_guard<std::mutex> lk(mSubscriptionLock);
+		for (auto & runner : mRunners) {
+			runner->getIntentQueueStats(stats);
+		}
+		return stats;
 	}
 	
 	void printIntentTiming() const {
 		size_t maxName = 1;
-		std::vector<std::tuple<std::string, std::string, uint64_t>> records;
-		for (auto & handler : mHandlers) {
-			for (auto & timing : handler.second->getIntentTiming()) {
-				if (timing.first.first.length() + timing.first.second.length() + 1 >= maxName)
-					maxName = timing.first.first.length() + timing.first.second.length() + 1;
-				records.emplace_back(timing.first.first, timing.first.second, timing.second);
-			}
+		auto records = getIntentTimingSnapshot();
+		for (auto & record : records) {
+			if (record.intent.length() + record.subscriber.length() + 1 >= maxName)
+				maxName = record.intent.length() + record.subscriber.length() + 1;
 		}
 		std::sort(records.begin(), records.end(), [](const auto & a, const auto & b) {
-			if (std::get<2>(a) == std::get<2>(b)) {
-				if (std::get<1>(a) == std::get<1>(b))
-					return std::get<0>(a) < std::get<0>(b);
-				return std::get<1>(a) < std::get<1>(b);
+			if (a.runTime.mean == b.runTime.mean) {
+				if (a.subscriber == b.subscriber)
+					return a.intent < b.intent;
+				return a.subscriber < b.subscriber;
 			}
-			return std::get<2>(a) > std::get<2>(b);
+			return a.runTime.mean > b.runTime.mean;
 		});
 		Log::data("Intent Timing:");
 		for (auto & record : records) {
-			const auto intentName = std::get<0>(record);
-			const auto serviceName = std::get<1>(record);
-			const auto intentTime = std::get<2>(record);
-			const auto nameLength = maxName - intentName.length() - 1;
-			const auto formatString = "        %s %-"+std::to_string(nameLength)+"s   %.3fus";
-			Log::data(formatString.c_str(), intentName.c_str(), serviceName.c_str(), intentTime / 1000.0);
+			const auto nameLength = maxName - record.intent.length() - 1;
+			const auto formatString = "        %s %-"+std::to_string(nameLength)+"s   %.3fus   p50 %.3fus   p99 %.3fus   p999 %.3fus   max %.3fus   wait p99 %.3fus";
+			Log::data(formatString.c_str(), record.intent.c_str(), record.subscriber.c_str(), record.runTime.mean / 1000.0,
+					record.runTime.p50 / 1000.0, record.runTime.p99 / 1000.0, record.runTime.p999 / 1000.0, record.runTime.max / 1000.0,
+					record.queueWait.p99 / 1000.0);
 		}
 	}
 	
 	private:
-	std::vector<std::pair<std::type_index, std::shared_ptr<IntentManagerHelper::GenericIntentRunner>>> mHandlers;
-	LinkedBlockingQueue<IntentCallbackCompiled> mExecutionQueue;
+	mutable std::mutex mSubscriptionLock;
+	IntentManagerHelper::IntentRunnerTable mRunnerTable;
+	std::vector<std::shared_ptr<IntentManagerHelper::GenericIntentRunner>> mRunners;
+	uint64_t mNextSubscriptionId{1};
+	std::unordered_map<std::string, std::shared_ptr<IntentManagerHelper::IntentStrand>> mStrands;
+	std::unordered_map<std::string, std::shared_ptr<ResourceAccount>> mAccounts;
+	IntentManagerHelper::IntentExecutionQueue mExecutionQueue;
 	std::atomic_bool mRunning{true};
-	
+	std::mutex mSchedulerLock;
+	std::unique_ptr<ScheduledThreadPool<std::function<void()>>> mScheduler;
+	std::unique_ptr<IntentManagerHelper::IntentWorkers> mWorkers; // after the scheduler, whose tasks it may run
+	std::vector<std::shared_ptr<IntentManagerHelper::IntentWorkers>> mExecutors;
+	uint32_t mTimingInterval{1};
+	bool mAccounting{false};
+
 };
 
 } // namespace jlcommon
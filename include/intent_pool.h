@@ -0,0 +1,129 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <new>
+
+namespace jlcommon {
+
+/**
+ * Recycles intent instances for high-rate broadcasters. acquire() hands out a previously used instance wrapped in a
+ * shared_ptr whose control block also comes from the pool; once the last subscriber drops it, both go back to the pool.
+ * In steady state, acquiring and broadcasting (see IntentManager::broadcastShared) therefore performs no heap
+ * allocations for the payload.
+ *
+ * Recycled instances keep their previous contents, so containers keep their capacity: the broadcaster is responsible
+ * for overwriting every field.
+ */
+template<typename T>
+class IntentPool {
+	public:
+	explicit IntentPool(size_t maxIdle = 1024) : mState(std::make_shared<State>(maxIdle)) { }
+	
+	std::shared_ptr<T> acquire() {
+		T * object = mState->takeObject();
+		if (object == nullptr)
+			object = new T{};
+		return std::shared_ptr<T>(object, Recycler{mState}, BlockAllocator<T>{mState});
+	}
+	
+	[[nodiscard]] size_t getIdleCount() const {
+		std::lock_guard<std::mutex> lk(mState->lock);
+		return mState->objects.size();
+	}
+	
+	private:
+	struct State {
+		explicit State(size_t maxIdle) : maxIdle(maxIdle) { }
+		~State() {
+			for (auto object : objects)
+				delete object;
+			for (auto block : blocks)
+				::operator delete(block);
+		}
+		
+		T * takeObject() {
+			std::lock_guard<std::mutex> lk(lock);
+			if (objects.empty())
+				return nullptr;
+			T * object = objects.back();
+			objects.pop_back();
+			return object;
+		}
+		
+		void returnObject(T * object) {
+			{
+				std::lock_guard<std::mutex> lk(lock);
+				if (objects.size() < maxIdle) {
+					objects.push_back(object);
+					return;
+				}
+			}
+			delete object;
+		}
+		
+		/**
+		 * Control blocks of one pool all have the same size, so the first size requested is the one recycled
+		 */
+		void * allocateBlock(size_t size) {
+			{
+				std::lock_guard<std::mutex> lk(lock);
+				if (blockSize == 0)
+					blockSize = size;
+				if (size == blockSize && !blocks.empty()) {
+					void * block = blocks.back();
+					blocks.pop_back();
+					return block;
+				}
+			}
+			return ::operator new(size);
+		}
+		
+		void releaseBlock(void * block, size_t size) {
+			{
+				std::lock_guard<std::mutex> lk(lock);
+				if (size == blockSize && blocks.size() < maxIdle) {
+					blocks.push_back(block);
+					return;
+				}
+			}
+			::operator delete(block);
+		}
+		
+		mutable std::mutex lock;
+		const size_t maxIdle;
+		std::vector<T*> objects;
+		std::vector<void*> blocks;
+		size_t blockSize{0};
+	};
+	
+	struct Recycler {
+		std::shared_ptr<State> state;
+		void operator()(T * object) const { state->returnObject(object); }
+	};
+	
+	template<typename U>
+	struct BlockAllocator {
+		using value_type = U;
+		
+		explicit BlockAllocator(std::shared_ptr<State> state) noexcept : state(std::move(state)) { }
+		template<typename V>
+		BlockAllocator(const BlockAllocator<V> & other) noexcept : state(other.state) { } // NOLINT(google-explicit-constructor)
+		
+		U * allocate(size_t n) { return static_cast<U*>(state->allocateBlock(n * sizeof(U))); }
+		void deallocate(U * p, size_t n) noexcept { state->releaseBlock(p, n * sizeof(U)); }
+		
+		template<typename V>
+		bool operator==(const BlockAllocator<V> & other) const noexcept { return state == other.state; }
+		template<typename V>
+		bool operator!=(const BlockAllocator<V> & other) const noexcept { return state != other.state; }
+		
+		std::shared_ptr<State> state;
+	};
+	
+	std::shared_ptr<State> mState;
+};
+
+} // namespace jlcommon
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "intent_manager.h"
+#include "log.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace jlcommon {
+
+/*
+ * Recording file format, in native byte order: the 8 byte magic "JLCINTR1", followed by one record per broadcast made
+ * of three unsigned LEB128 varints (nanoseconds since the previous record, type id, payload size) and the payload.
+ */
+
+template<typename T>
+using IntentSerializer = std::function<void(const T & intent, std::string & out)>;
+template<typename T>
+using IntentDeserializer = std::function<T(const char * data, size_t size)>;
+
+namespace IntentRecorderHelper {
+
+/**
+ * Appends records to a recording file. Thread-safe, so broadcasts from any thread can be recorded; a write() racing
+ * with close() is either complete before it or dropped.
+ */
+class RecordingWriter {
+	public:
+	RecordingWriter() = default;
+	~RecordingWriter();
+	RecordingWriter(const RecordingWriter &) = delete;
+	RecordingWriter & operator=(const RecordingWriter &) = delete;
+	
+	bool open(const std::string & path);
+	void close();
+	[[nodiscard]] inline bool isOpen() const noexcept { return mOpen.load(std::memory_order_acquire); }
+	void write(uint32_t type, const void * data, size_t size) noexcept;
+	[[nodiscard]] uint64_t getRecordCount() const noexcept { return mRecordCount.load(std::memory_order_relaxed); }
+	
+	private:
+	mutable std::mutex mLock;
+	FILE * mFile{nullptr};
+	std::chrono::steady_clock::time_point mPrevious;
+	std::atomic_uint64_t mRecordCount{0};
+	std::atomic_bool mOpen{false}; // lets write() skip the lock while not recording
+};
+
+/**
+ * Reads the records of a recording file in order
+ */
+class RecordingReader {
+	public:
+	RecordingReader() = default;
+	~RecordingReader();
+	RecordingReader(const RecordingReader &) = delete;
+	RecordingReader & operator=(const RecordingReader &) = delete;
+	
+	static constexpr uint64_t MAX_PAYLOAD_SIZE = 64 * 1024 * 1024;
+	
+	bool open(const std::string & path);
+	/**
+	 * @param delay nanoseconds between the previous record and this one
+	 * @return FALSE at the end of the file, or if it is truncated or corrupt
+	 */
+	bool next(uint64_t & delay, uint32_t & type, std::string & payload);
+	
+	private:
+	FILE * mFile{nullptr};
+	uint64_t mFileSize{0};
+	
+	bool readVarint(uint64_t & value);
+};
+
+template<typename T>
+inline void serializeTrivially(const T & intent, std::string & out) {
+	out.assign(reinterpret_cast<const char *>(&intent), sizeof(T));
+}
+
+template<typename T>
+inline T deserializeTrivially(const char * data, size_t size) {
+	if (size != sizeof(T))
+		throw std::runtime_error("recorded intent has the wrong size");
+	alignas(T) unsigned char storage[sizeof(T)];
+	std::memcpy(storage, data, sizeof(T));
+	return *std::launder(reinterpret_cast<const T *>(storage));
+}
+
+} // namespace IntentRecorderHelper
+
+/**
+ * Captures the broadcasts of selected intent types, with their timing, into a recording file that an IntentReplayer can
+ * play back later. Recording happens in an inline subscriber, on the broadcasting thread, which shares the writer so
+ * that a broadcast still running after stop() or the recorder's destruction finds it closed rather than freed.
+ */
+class IntentRecorder {
+	public:
+	explicit IntentRecorder(std::shared_ptr<IntentManager> intentManager) : mIntentManager(std::move(intentManager)) { }
+	~IntentRecorder() {
+		stop();
+		for (auto & subscription : mSubscriptions)
+			mIntentManager->unsubscribe(subscription);
+	}
+	IntentRecorder(const IntentRecorder &) = delete;
+	IntentRecorder & operator=(const IntentRecorder &) = delete;
+	
+	/**
+	 * Records T, which must be trivially copyable
+	 * @param type identifier of T in the recording, which the replayer must register as well
+	 */
+	template<typename T>
+	bool record(uint32_t type) {
+		static_assert(std::is_trivially_copyable_v<T>, "record intents that are not trivially copyable with a serializer");
+		return record<T>(type, IntentRecorderHelper::serializeTrivially<T>);
+	}
+	
+	template<typename T>
+	bool record(uint32_t type, IntentSerializer<T> serializer) {
+		std::lock_guard<std::mutex> lk(mLock);
+		mSubscriptions.emplace_back(mIntentManager->subscribeInline<T>("IntentRecorder", [writer = mWriter, type, serializer = std::move(serializer)](const T & intent) {
+			if (!writer->isOpen())
+				return;
+			thread_local std::string buffer;
+			serializer(intent, buffer);
+			writer->write(type, buffer.data(), buffer.size());
+		}));
+		return mSubscriptions.back().isValid();
+	}
+	
+	/**
+	 * Starts writing broadcasts to a new recording file, replacing any existing one
+	 */
+	bool start(const std::string & path) {
+		std::lock_guard<std::mutex> lk(mLock);
+		return !mWriter->isOpen() && mWriter->open(path);
+	}
+	
+	/**
+	 * Stops recording and closes the file. Every registered type stays registered for the next start().
+	 */
+	void stop() {
+		std::lock_guard<std::mutex> lk(mLock);
+		mWriter->close();
+	}
+	
+	[[nodiscard]] inline uint64_t getRecordCount() const noexcept { return mWriter->getRecordCount(); }
+	
+	private:
+	const std::shared_ptr<IntentManager> mIntentManager;
+	std::mutex mLock;
+	std::vector<IntentSubscription> mSubscriptions;
+	const std::shared_ptr<IntentRecorderHelper::RecordingWriter> mWriter{std::make_shared<IntentRecorderHelper::RecordingWriter>()};
+};
+
+/**
+ * Broadcasts the intents of a recording file into an IntentManager, at the recorded pace or faster
+ */
+class IntentReplayer {
+	public:
+	static constexpr double AS_FAST_AS_POSSIBLE = 0;
+	
+	explicit IntentReplayer(std::shared_ptr<IntentManager> intentManager) : mIntentManager(std::move(intentManager)) { }
+	
+	template<typename T>
+	void replay(uint32_t type) {
+		static_assert(std::is_trivially_copyable_v<T>, "replay intents that are not trivially copyable with a deserializer");
+		replay<T>(type, IntentRecorderHelper::deserializeTrivially<T>);
+	}
+	
+	template<typename T>
+	void replay(uint32_t type, IntentDeserializer<T> deserializer) {
+		mDecoders[type] = [intentManager = mIntentManager, deserializer = std::move(deserializer)](const std::string & payload) {
+			intentManager->broadcast(deserializer(payload.data(), payload.size()));
+		};
+	}
+	
+	/**
+	 * Plays the recording back on the calling thread, returning once every record was broadcast or stop() was called.
+	 * Records of unregistered types, or that fail to deserialize, are skipped.
+	 * @param speed 1 for the recorded pace, N for N times faster, or AS_FAST_AS_POSSIBLE
+	 * @return the number of intents broadcast
+	 */
+	uint64_t run(const std::string & path, double speed = 1);
+	
+	/**
+	 * Makes a run() in progress on another thread return early, as well as any later run() until reset()
+	 */
+	inline void stop() noexcept { mStopped = true; }
+	
+	/**
+	 * Allows run() again after stop()
+	 */
+	inline void reset() noexcept { mStopped = false; }
+	
+	private:
+	const std::shared_ptr<IntentManager> mIntentManager;
+	std::unordered_map<uint32_t, std::function<void(const std::string &)>> mDecoders;
+	std::atomic_bool mStopped{false};
+};
+
+} // namespace jlcommon
@@ -0,0 +1,171 @@
+#pragma once
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * The rings rely on the uapi of Linux 6.1 (deferred task work, multishot receives). Built against older headers, or
+ * none, every IoUring fails to open and its users fall back to plain system calls.
+ */
+#if defined(IORING_SETUP_DEFER_TASKRUN) && defined(IORING_RECV_MULTISHOT)
+#define JLCOMMON_IO_URING 1
+#else
+#define JLCOMMON_IO_URING 0
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace jlcommon {
+
+/**
+ * A minimal io_uring instance driven with the raw system calls, so no liburing is needed. Only one thread at a time may
+ * use it: getSqe() and submit() from the submitter, and reap() from whichever thread waits for completions.
+ *
+ * Creation fails, and isOpen() returns FALSE, where io_uring is missing or disabled (old kernels, seccomp, the
+ * kernel.io_uring_disabled sysctl), so callers can fall back to plain system calls.
+ */
+class IoUring {
+	public:
+	/**
+	 * @param entries submission queue size, rounded up to a power of two by the kernel
+	 * @param singleIssuer a single thread submits and waits for completions, which lets the kernel defer completion
+	 *        work until it is asked for them. The ring then starts disabled, so that it can be prepared by another
+	 *        thread, until the issuing thread calls enable().
+	 * @param completions completion queue size if not 0, otherwise twice the submission queue
+	 */
+	explicit IoUring(unsigned entries, bool singleIssuer = false, unsigned completions = 0);
+	~IoUring();
+	IoUring(const IoUring &) = delete;
+	IoUring & operator=(const IoUring &) = delete;
+	
+	[[nodiscard]] inline bool isOpen() const noexcept { return mFd != -1; }
+	[[nodiscard]] inline int getFd() const noexcept { return mFd; }
+	[[nodiscard]] inline unsigned getSqEntries() const noexcept { return mSqEntries; }
+	
+	/**
+	 * Returns TRUE if the kernel reported the opcode as supported, through IORING_REGISTER_PROBE when the ring was created
+	 */
+	[[nodiscard]] inline bool isSupported(uint8_t opcode) const noexcept { return mSupported.test(opcode); }
+	
+	/**
+	 * Makes the calling thread the issuer of a ring created with singleIssuer
+	 * @return FALSE if the kernel refused
+	 */
+	bool enable() noexcept;
+	
+	/**
+	 * Returns a zeroed submission entry, or nullptr if the queue is full until the next submit()
+	 */
+	io_uring_sqe * getSqe() noexcept;
+	
+	/**
+	 * Submits the queued entries and waits until at least waitFor completions are available
+	 * @return the number of entries submitted, or a negated errno
+	 */
+	int submit(unsigned waitFor = 0) noexcept;
+	
+	/**
+	 * Calls handler(const io_uring_cqe &) for every available completion, then releases them to the kernel
+	 * @return the number of completions handled
+	 */
+	template<typename Handler>
+	unsigned reap(Handler && handler) {
+#if JLCOMMON_IO_URING
+		unsigned head = *mCqHead;
+		const unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+		unsigned count = 0;
+		for (; head != tail; head++, count++)
+			handler(mCqes[head & mCqMask]);
+		__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+		return count;
+#else
+		(void) handler;
+		return 0;
+#endif
+	}
+	
+	private:
+	int mFd;
+	bool mDisabled;
+	unsigned mSqEntries;
+	unsigned mSqTail;     // local copy, published by submit()
+	unsigned mSqSubmitted;
+	unsigned * mSqHead;
+	unsigned * mSqTailShared;
+	unsigned mSqMask;
+	io_uring_sqe * mSqes;
+	unsigned * mCqHead;
+	unsigned * mCqTail;
+	unsigned mCqMask;
+	io_uring_cqe * mCqes;
+	void * mSqRing;
+	size_t mSqRingSize;
+	void * mCqRing;       // same as mSqRing when the kernel maps both together
+	size_t mCqRingSize;
+	size_t mSqesSize;
+	std::bitset<256> mSupported;
+	
+	void close() noexcept;
+	void probe();
+};
+
+/**
+ * Fixed-size buffers provided to an IoUring as one buffer group. Receives posted with IOSQE_BUFFER_SELECT and this
+ * group take the next free buffer themselves, so one multishot receive can keep completing without being posted again;
+ * each completion names the buffer it filled, which must be handed back with recycle() once consumed.
+ *
+ * Buffers are provided with IORING_OP_PROVIDE_BUFFERS entries queued on the ring, which go to the kernel with its next
+ * submit(), so handing them back costs no system call of its own. Their completions carry getUserData() and can be
+ * ignored, since the kernel only rejects them for lack of memory.
+ */
+class IoUringBufferGroup {
+	public:
+	/**
+	 * @param count number of buffers, at most 65536
+	 * @param userData of the completions of the entries this queues
+	 */
+	IoUringBufferGroup(IoUring & ring, uint16_t group, unsigned count, size_t bufferSize, uint64_t userData);
+	IoUringBufferGroup(const IoUringBufferGroup &) = delete;
+	IoUringBufferGroup & operator=(const IoUringBufferGroup &) = delete;
+	
+	/**
+	 * Returns FALSE if the buffers could not be queued, which leaves receives without buffers
+	 */
+	[[nodiscard]] inline bool isOpen() const noexcept { return mOpen; }
+	[[nodiscard]] inline uint16_t getGroup() const noexcept { return mGroup; }
+	[[nodiscard]] inline uint64_t getUserData() const noexcept { return mUserData; }
+	[[nodiscard]] inline size_t getBufferSize() const noexcept { return mBufferSize; }
+	
+	[[nodiscard]] inline char * getBuffer(uint16_t id) const noexcept { return mBuffers.get() + static_cast<size_t>(id) * mBufferSize; }
+	
+	/**
+	 * Sets a buffer aside to be handed back by the next commit()
+	 */
+	inline void recycle(uint16_t id) { mRecycled.push_back(id); }
+	
+	/**
+	 * Queues the recycled buffers on the ring, one entry per run of consecutive ids
+	 * @return FALSE if the submission queue is full, in which case the buffers stay set aside for the next commit()
+	 */
+	bool commit() noexcept;
+	
+	private:
+	IoUring & mRing;
+	uint16_t mGroup;
+	size_t mBufferSize;
+	uint64_t mUserData;
+	std::unique_ptr<char[]> mBuffers;
+	std::vector<uint16_t> mRecycled;
+	bool mOpen;
+	
+	bool provide(uint16_t first, unsigned count) noexcept;
+};
+
+} // namespace jlcommon
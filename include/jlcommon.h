@@ -3,9 +3,17 @@
 #include "log.h"
 #include "blocking_queue.h"
 #include "thread_pool.h"
+#include "event_loop.h"
 #include "inet_address.h"
 #include "udp_server.h"
+#include "latency_histogram.h"
+#include "resource_account.h"
+#include "lifecycle_profile.h"
+#include "trace.h"
 #include "intent_manager.h"
+#include "intent_pool.h"
+#include "shared_memory_bus.h"
+#include "intent_recorder.h"
 #include "manager.h"
 #include "service.h"
 
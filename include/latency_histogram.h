@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace jlcommon {
+
+struct LatencySnapshot {
+	uint64_t count = 0;
+	uint64_t mean = 0; // nanoseconds
+	uint64_t p50 = 0;  // nanoseconds
+	uint64_t p99 = 0;  // nanoseconds
+	uint64_t p999 = 0; // nanoseconds
+	uint64_t max = 0;  // nanoseconds
+};
+
+/**
+ * Lock-free log-linear histogram of nanosecond latencies, in the style of HdrHistogram. Every power of two is split into
+ * 2^SUB_BUCKET_BITS linear sub-buckets, so recorded values keep a relative precision of about 6% regardless of
+ * magnitude. Recording is a handful of relaxed atomic operations and is safe from any number of threads.
+ */
+class LatencyHistogram {
+	public:
+	static constexpr unsigned int SUB_BUCKET_BITS = 4;
+	static constexpr unsigned int SUB_BUCKET_COUNT = 1u << SUB_BUCKET_BITS;
+	static constexpr unsigned int MAX_EXPONENT = 36; // ~68s, larger values land in the last bucket
+	static constexpr unsigned int BUCKET_COUNT = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKET_COUNT;
+	
+	LatencyHistogram() = default;
+	LatencyHistogram(const LatencyHistogram &) = delete;
+	LatencyHistogram & operator=(const LatencyHistogram &) = delete;
+	
+	inline void record(uint64_t nanoseconds) noexcept {
+		mBuckets[getBucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+		mCount.fetch_add(1, std::memory_order_relaxed);
+		mSum.fetch_add(nanoseconds, std::memory_order_relaxed);
+		uint64_t max = mMax.load(std::memory_order_relaxed);
+		while (nanoseconds > max && !mMax.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed));
+	}
+	
+	[[nodiscard]] inline uint64_t getCount() const noexcept { return mCount.load(std::memory_order_relaxed); }
+	[[nodiscard]] inline uint64_t getSum() const noexcept { return mSum.load(std::memory_order_relaxed); }
+	[[nodiscard]] inline uint64_t getMax() const noexcept { return mMax.load(std::memory_order_relaxed); }
+	
+	/**
+	 * Returns the value below which the requested fraction of recordings fall, reported as the upper bound of its bucket
+	 * @param quantile the fraction, between 0 and 1
+	 */
+	[[nodiscard]] uint64_t getValueAtQuantile(double quantile) const noexcept;
+	
+	/**
+	 * Captures count, mean, p50, p99, p999 and max. Concurrent recordings may be partially included.
+	 */
+	[[nodiscard]] LatencySnapshot snapshot() const noexcept;
+	
+	void reset() noexcept;
+	
+	static inline unsigned int getBucketIndex(uint64_t value) noexcept {
+		if (value < SUB_BUCKET_COUNT)
+			return static_cast<unsigned int>(value);
+#if defined(_MSC_VER)
+		unsigned long msb;
+		_BitScanReverse64(&msb, value);
+		auto exponent = static_cast<unsigned int>(msb);
+#else
+		auto exponent = static_cast<unsigned int>(63 - __builtin_clzll(value));
+#endif
+		if (exponent > MAX_EXPONENT)
+			return BUCKET_COUNT - 1;
+		const unsigned int shift = exponent - SUB_BUCKET_BITS;
+		return (shift + 1) * SUB_BUCKET_COUNT + static_cast<unsigned int>(value >> shift) - SUB_BUCKET_COUNT;
+	}
+	
+	/**
+	 * Returns the largest value that maps to the bucket
+	 */
+	static uint64_t getBucketUpperBound(unsigned int index) noexcept;
+	
+	private:
+	std::array<std::atomic_uint64_t, BUCKET_COUNT> mBuckets{};
+	std::atomic_uint64_t mCount{0};
+	std::atomic_uint64_t mSum{0};
+	std::atomic_uint64_t mMax{0};
+};
+
+} // namespace jlcommon
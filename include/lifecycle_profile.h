@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace jlcommon {
+
+enum class LifecyclePhase : uint8_t {
+	INITIALIZE,
+	START,
+	STOP,
+	TERMINATE
+};
+
+constexpr size_t LIFECYCLE_PHASE_COUNT = 4;
+
+const char * getLifecyclePhaseName(LifecyclePhase phase) noexcept;
+
+/**
+ * The last run of one lifecycle phase, on the steady clock
+ */
+struct LifecyclePhaseTiming {
+	uint64_t beginNanoseconds = 0;
+	uint64_t durationNanoseconds = 0;
+	bool ran = false;
+	bool succeeded = false;
+	
+	[[nodiscard]] inline uint64_t getEndNanoseconds() const noexcept { return beginNanoseconds + durationNanoseconds; }
+};
+
+/**
+ * Lifecycle timings of one service and, for a Manager, of everything below it. A Manager's own timing covers its
+ * children, so the difference is the time spent waiting on dependencies or in the Manager itself.
+ */
+struct ServiceLifecycleProfile {
+	std::string name;
+	std::array<LifecyclePhaseTiming, LIFECYCLE_PHASE_COUNT> phases{};
+	std::vector<ServiceLifecycleProfile> children;
+	
+	[[nodiscard]] inline const LifecyclePhaseTiming & getPhase(LifecyclePhase phase) const noexcept { return phases[static_cast<size_t>(phase)]; }
+	
+	/**
+	 * Formats the tree as a table with one row per service and one column per phase, in milliseconds. A "+" after a
+	 * time is the offset from the start of the root's phase, showing when the service got its turn; a failed phase is
+	 * marked with "!" and one that never ran with "-".
+	 */
+	[[nodiscard]] std::string getReport() const;
+	
+	/**
+	 * Returns the tree as JSON, with times in nanoseconds, for tools and CI checks:
+	 * {"name":"...","phases":{"initialize":{"begin":N,"duration":N,"succeeded":true},...},"children":[...]}.
+	 * Phases that never ran are left out.
+	 */
+	[[nodiscard]] std::string getJson() const;
+	bool dumpJson(const std::string & path) const;
+};
+
+} // namespace jlcommon
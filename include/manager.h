@@ -5,6 +5,8 @@
 #pragma once
 
 #include "service.h"
+#include "thread_pool.h"
+#include "trace.h"
 #include "log.h"
 
 #include <vector>
@@ -15,6 +17,12 @@
 #include <thread>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <utility>
 
 namespace jlcommon {
 
@@ -26,12 +34,33 @@ class Manager : public T {
 	~Manager() override = default;
 	
 	void addChild(std::shared_ptr<T> service) {
+		service->setHealthMonitor(healthMonitor);
 		services.emplace_back(std::move(service));
 	}
 	
+	/**
+	 * Adds a child whose intent handlers and tasks run on the executor instead of the IntentManager's own execution,
+	 * e.g. IntentExecutor::createDedicated(cpu) for a latency-sensitive service, or one pool shared by heavy services
+	 */
+	void addChild(std::shared_ptr<T> service, std::shared_ptr<IntentExecutor> executor) {
+		auto intentManager = T::getIntentManager();
+		if (intentManager)
+			intentManager->setExecutor(service->name(), executor);
+		executors.emplace_back(service->name(), std::move(executor));
+		addChild(std::move(service));
+	}
+	
 	template<typename Service>
 	void addChild() {
-		services.emplace_back(std::make_shared<Service>());
+		addChild(std::make_shared<Service>());
+	}
+	
+	/**
+	 * Sets how many threads run the lifecycle of independent children concurrently. With the default of 1, every
+	 * child runs on the calling thread, one at a time, in dependency order.
+	 */
+	inline void setLifecycleThreads(unsigned int threads) noexcept {
+		lifecycleThreads = (threads == 0) ? 1 : threads;
 	}
 	
 	inline void forEachChild(const std::function<void(const std::shared_ptr<T> &)>& handler) {
@@ -41,17 +70,22 @@ class Manager : public T {
 	}
 	
 	/**
-	 * Initializes and starts all services, waiting for any to report that they are no longer operational or the continuePredicate to return false, with a caller-determined periodic sleep.
+	 * Initializes and starts all services, waiting for any to report that they are no longer operational, for the continuePredicate to return false or for requestStop(), with a caller-determined periodic sleep.
+	 * Reported health changes end the sleep early.
 	 * @return TRUE if all services were started successfully, FALSE otherwise
 	 */
 	template<typename _Rep, typename _Period>
 	bool startRunStop(std::chrono::duration<_Rep, _Period> periodicSleep, const std::function<bool()> & continuePredicate) {
+		stopRequested = false;
 		if (!initialize())
 			return false;
 		if (!start())
 			return false;
-		while (continuePredicate() && isOperational()) {
-			std::this_thread::sleep_for(periodicSleep);
+		while (true) {
+			const uint64_t generation = healthMonitor->getGeneration();
+			if (stopRequested || !continuePredicate() || !isOperational())
+				break;
+			healthMonitor->waitFor(generation, periodicSleep);
 		}
 		stop();
 		terminate();
@@ -59,59 +93,63 @@ class Manager : public T {
 	}
 	
 	/**
-	 * Initializes and starts all services, waiting for any to report that they are no longer operational, with a periodic sleep of 100ms.
+	 * Initializes and starts all services, waiting for any to report that they are no longer operational or for requestStop().
+	 * If every service reports its health, this sleeps until something changes; otherwise the services are also polled every 100ms.
 	 * @return TRUE if all services were started successfully, FALSE otherwise
 	 */
 	bool startRunStop() noexcept {
 		using namespace std::chrono_literals;
-		return startRunStop(100ms, []() -> bool { return true; });
+		stopRequested = false;
+		if (!initialize())
+			return false;
+		if (!start())
+			return false;
+		const bool polling = !reportsHealth();
+		while (true) {
+			const uint64_t generation = healthMonitor->getGeneration();
+			if (stopRequested || !isOperational())
+				break;
+			if (polling)
+				healthMonitor->waitFor(generation, 100ms);
+			else
+				healthMonitor->wait(generation);
+		}
+		stop();
+		terminate();
+		return true;
+	}
+	
+	/**
+	 * Makes startRunStop() stop and terminate all services, from any thread
+	 */
+	void requestStop() noexcept {
+		stopRequested = true;
+		healthMonitor->notify();
 	}
 	
+	/**
+	 * Initializes the children in dependency order. Unlike earlier versions, which logged failures and still returned
+	 * TRUE, a failing child stops the phase: the children already initialized are terminated again, and this returns
+	 * FALSE.
+	 */
 	bool initialize() noexcept override {
-		for (auto & s : services) {
-			try {
-				if (s->initialize()) {
-					initializedServices.emplace_back(s);
-					continue;
-				}
-				
-				Log::error("Failed to initialize service: %s\n", s->name().c_str());
-			} catch (const std::exception & e) {
-				Log::error("Failed to initialize service: %s due to exception: %s\n", s->name().c_str(), e.what());
-			} catch (const std::string & e) {
-				Log::error("Failed to initialize service: %s due to exception: %s\n", s->name().c_str(), e.c_str());
-			} catch (const char * e) {
-				Log::error("Failed to initialize service: %s due to exception: %s\n", s->name().c_str(), e);
-			} catch (...) {
-				Log::error("Failed to initialize service: %s due to an unknown exception\n", s->name().c_str());
-			}
-			terminate();
-		}
-		return true;
+		if (runPhase(services, LifecyclePhase::INITIALIZE, false, [](T & s) { return s.initialize(); }, initializedServices))
+			return true;
+		terminate();
+		return false;
 	}
 	
+	/**
+	 * Starts the children in dependency order. Unlike earlier versions, which logged failures and still returned TRUE
+	 * with the rest of the children started, a failing child stops the phase: the children already started are
+	 * stopped, every initialized child is terminated, and this returns FALSE.
+	 */
 	bool start() noexcept override {
-		for (auto & s : services) {
-			try {
-				if (s->start()) {
-					startedServices.emplace_back(s);
-					continue;
-				}
-				
-				Log::error("Failed to start service: %s\n", s->name().c_str());
-			} catch (const std::exception & e) {
-				Log::error("Failed to start service: %s due to exception: %s\n", s->name().c_str(), e.what());
-			} catch (const std::string & e) {
-				Log::error("Failed to start service: %s due to exception: %s\n", s->name().c_str(), e.c_str());
-			} catch (const char * e) {
-				Log::error("Failed to start service: %s due to exception: %s\n", s->name().c_str(), e);
-			} catch (...) {
-				Log::error("Failed to start service: %s due to an unknown exception\n", s->name().c_str());
-			}
-			stop();
-			terminate();
-		}
-		return true;
+		if (runPhase(services, LifecyclePhase::START, false, [](T & s) { return s.start(); }, startedServices))
+			return true;
+		stop();
+		terminate();
+		return false;
 	}
 	
 	[[nodiscard]] bool isOperational() const noexcept override {
@@ -123,62 +161,286 @@ class Manager : public T {
 	}
 	
 	bool stop() noexcept override {
-		for (auto & s : startedServices) {
-			try {
-				if (s->stop())
-					continue;
-				
-				Log::error("Failed to stop service: %s\n", s->name().c_str());
-			} catch (const std::exception & e) {
-				Log::error("Failed to stop service: %s due to exception: %s\n", s->name().c_str(), e.what());
-			} catch (const std::string & e) {
-				Log::error("Failed to stop service: %s due to exception: %s\n", s->name().c_str(), e.c_str());
-			} catch (const char * e) {
-				Log::error("Failed to stop service: %s due to exception: %s\n", s->name().c_str(), e);
-			} catch (...) {
-				Log::error("Failed to stop service: %s due to an unknown exception\n", s->name().c_str());
-			}
-		}
+		std::vector<std::shared_ptr<T>> stopped;
+		const bool success = runPhase(startedServices, LifecyclePhase::STOP, true, [](T & s) { return s.stop(); }, stopped);
 		startedServices.clear();
-		return true;
+		return success;
 	}
 	
 	bool terminate() noexcept override {
-		for (auto & s : initializedServices) {
-			try {
-				if (s->terminate())
-					continue;
-				Log::error("Failed to terminate service: %s\n", s->name().c_str());
-			} catch (const std::exception & e) {
-				Log::error("Failed to terminate service: %s due to exception: %s\n", s->name().c_str(), e.what());
-			} catch (const std::string & e) {
-				Log::error("Failed to terminate service: %s due to exception: %s\n", s->name().c_str(), e.c_str());
-			} catch (const char * e) {
-				Log::error("Failed to terminate service: %s due to exception: %s\n", s->name().c_str(), e);
-			} catch (...) {
-				Log::error("Failed to terminate service: %s due to an unknown exception\n", s->name().c_str());
-			}
-		}
+		std::vector<std::shared_ptr<T>> terminated;
+		const bool success = runPhase(initializedServices, LifecyclePhase::TERMINATE, true, [](T & s) { return s.terminate(); }, terminated);
 		initializedServices.clear();
+		return success;
+	}
+	
+	/**
+	 * TRUE if every child reports its health, so that the manager itself never needs to be polled
+	 */
+	[[nodiscard]] bool reportsHealth() const noexcept override {
+		for (auto & s : services) {
+			if (!s->reportsHealth())
+				return false;
+		}
 		return true;
 	}
 	
+	/**
+	 * Returns the worst health of the manager and its children
+	 */
+	[[nodiscard]] ServiceHealth getHealth() const noexcept override {
+		ServiceHealth health = T::getHealth();
+		for (auto & s : services) {
+			health = std::max(health, s->getHealth());
+		}
+		return health;
+	}
+	
+	void setHealthMonitor(std::shared_ptr<ServiceHealthMonitor> monitor) noexcept override {
+		healthMonitor->setParent(monitor);
+		T::setHealthMonitor(std::move(monitor));
+	}
+	
 	[[nodiscard]] std::string name() const noexcept override {
 		return "Manager";
 	}
 	
+	/**
+	 * Returns the resources charged to the manager itself and, recursively, to every child
+	 */
+	[[nodiscard]] ServiceResourceSnapshot getResourceSnapshot() const override {
+		auto snapshot = T::getResourceSnapshot();
+		snapshot.children.reserve(services.size());
+		for (auto & s : services) {
+			snapshot.children.emplace_back(s->getResourceSnapshot());
+			snapshot.total += snapshot.children.back().total;
+		}
+		return snapshot;
+	}
+	
+	/**
+	 * Returns the lifecycle timings of the manager itself and, recursively, of every child. Print getReport() to see
+	 * which service holds up startup or shutdown, or check getJson() in CI.
+	 */
+	[[nodiscard]] ServiceLifecycleProfile getLifecycleProfile() const override {
+		auto profile = T::getLifecycleProfile();
+		profile.children.reserve(services.size());
+		for (auto & s : services) {
+			profile.children.emplace_back(s->getLifecycleProfile());
+		}
+		return profile;
+	}
+	
 	void setIntentManager(std::shared_ptr<IntentManager> intentManager) noexcept override {
 		T::setIntentManager(intentManager);
 		for (auto & s : services) {
 			s->setIntentManager(intentManager);
 		}
+		if (intentManager) {
+			for (auto & executor : executors) {
+				intentManager->setExecutor(executor.first, executor.second);
+			}
+		}
 	}
 	
 	private:
 	std::vector<std::shared_ptr<T>> services;
 	std::vector<std::shared_ptr<T>> initializedServices;
 	std::vector<std::shared_ptr<T>> startedServices;
+	std::vector<std::pair<std::string, std::shared_ptr<IntentExecutor>>> executors;
+	unsigned int lifecycleThreads{1};
+	std::shared_ptr<ServiceHealthMonitor> healthMonitor{std::make_shared<ServiceHealthMonitor>()};
+	std::atomic_bool stopRequested{false};
+	
+	/**
+	 * Resolves the dependencies of each service to indices within the list. Dependencies that are not in the list are
+	 * an error when required, and otherwise ignored, since they were never started.
+	 * @return FALSE if a required dependency is missing or the dependencies form a cycle
+	 */
+	static bool getDependencies(const std::vector<std::shared_ptr<T>> & list, bool required, std::vector<std::vector<size_t>> & dependencies) {
+		std::unordered_map<std::string, std::vector<size_t>> indices;
+		for (size_t i = 0; i < list.size(); i++)
+			indices[list[i]->name()].push_back(i);
+		
+		dependencies.assign(list.size(), {});
+		std::vector<size_t> waiting(list.size(), 0);
+		std::vector<std::vector<size_t>> dependents(list.size());
+		for (size_t i = 0; i < list.size(); i++) {
+			for (const auto & dependency : list[i]->getDependencies()) {
+				auto found = indices.find(dependency);
+				if (found == indices.end()) {
+					if (required) {
+						Log::error("Service %s depends on unknown service %s\n", list[i]->name().c_str(), dependency.c_str());
+						return false;
+					}
+					continue;
+				}
+				for (size_t j : found->second) {
+					dependencies[i].push_back(j);
+					dependents[j].push_back(i);
+					waiting[i]++;
+				}
+			}
+		}
+		
+		// Kahn's algorithm: anything never reaching zero remaining dependencies is on a cycle
+		std::vector<size_t> ready;
+		for (size_t i = 0; i < list.size(); i++) {
+			if (waiting[i] == 0)
+				ready.push_back(i);
+		}
+		size_t visited = 0;
+		while (!ready.empty()) {
+			const size_t i = ready.back();
+			ready.pop_back();
+			visited++;
+			for (size_t dependent : dependents[i]) {
+				if (--waiting[dependent] == 0)
+					ready.push_back(dependent);
+			}
+		}
+		if (visited != list.size()) {
+			Log::error("Service dependencies form a cycle\n");
+			return false;
+		}
+		return true;
+	}
+	
+	/**
+	 * Runs the phase of one service, timing it on the steady clock into the service's lifecycle profile and, while
+	 * tracing is enabled, as a "lifecycle" span
+	 */
+	static bool runService(T & service, LifecyclePhase phase, const std::function<bool(T &)> & action) noexcept {
+		LifecyclePhaseTiming timing;
+		timing.ran = true;
+		timing.beginNanoseconds = Trace::now();
+		timing.succeeded = runServiceAction(service, getLifecyclePhaseName(phase), action);
+		const uint64_t end = Trace::now();
+		timing.durationNanoseconds = end - timing.beginNanoseconds;
+		service.recordLifecyclePhase(phase, timing);
+		if (Trace::isEnabled())
+			Trace::record("lifecycle", getLifecyclePhaseName(phase), service.name().c_str(), timing.beginNanoseconds, end);
+		return timing.succeeded;
+	}
 	
+	static bool runServiceAction(T & service, const char * phase, const std::function<bool(T &)> & action) noexcept {
+		try {
+			if (action(service))
+				return true;
+			
+			Log::error("Failed to %s service: %s\n", phase, service.name().c_str());
+		} catch (const std::exception & e) {
+			Log::error("Failed to %s service: %s due to exception: %s\n", phase, service.name().c_str(), e.what());
+		} catch (const std::string & e) {
+			Log::error("Failed to %s service: %s due to exception: %s\n", phase, service.name().c_str(), e.c_str());
+		} catch (const char * e) {
+			Log::error("Failed to %s service: %s due to exception: %s\n", phase, service.name().c_str(), e);
+		} catch (...) {
+			Log::error("Failed to %s service: %s due to an unknown exception\n", phase, service.name().c_str());
+		}
+		return false;
+	}
+	
+	/**
+	 * Runs one lifecycle phase over the list. In a forward phase a service runs once its dependencies succeeded, and
+	 * after the first failure nothing new is started. In a reverse phase a service runs once every service depending
+	 * on it finished, successfully or not, and every service is attempted.
+	 * The manager's own lifecycle profile records how long the whole phase took.
+	 * @param succeeded receives the services whose phase succeeded, in completion order
+	 * @return TRUE if the phase succeeded for every service
+	 */
+	bool runPhase(const std::vector<std::shared_ptr<T>> & list, LifecyclePhase phase, bool reverse, const std::function<bool(T &)> & action, std::vector<std::shared_ptr<T>> & succeeded) noexcept {
+		LifecyclePhaseTiming timing;
+		timing.ran = true;
+		timing.beginNanoseconds = Trace::now();
+		timing.succeeded = runPhaseInOrder(list, phase, reverse, action, succeeded);
+		timing.durationNanoseconds = Trace::now() - timing.beginNanoseconds;
+		this->recordLifecyclePhase(phase, timing);
+		return timing.succeeded;
+	}
+	
+	bool runPhaseInOrder(const std::vector<std::shared_ptr<T>> & list, LifecyclePhase phase, bool reverse, const std::function<bool(T &)> & action, std::vector<std::shared_ptr<T>> & succeeded) noexcept {
+		std::vector<std::vector<size_t>> dependencies;
+		try {
+			if (!getDependencies(list, !reverse, dependencies))
+				return false;
+		} catch (...) {
+			Log::error("Failed to %s services: unable to resolve dependencies\n", getLifecyclePhaseName(phase));
+			return false;
+		}
+		
+		// waitFor[i] counts what must finish before i runs, and unblocks[i] lists what waits on i
+		std::vector<size_t> waitFor(list.size(), 0);
+		std::vector<std::vector<size_t>> unblocks(list.size());
+		for (size_t i = 0; i < list.size(); i++) {
+			for (size_t j : dependencies[i]) {
+				if (reverse) {
+					waitFor[j]++;
+					unblocks[i].push_back(j);
+				} else {
+					waitFor[i]++;
+					unblocks[j].push_back(i);
+				}
+			}
+		}
+		std::deque<size_t> ready;
+		for (size_t i = 0; i < list.size(); i++) {
+			if (waitFor[i] == 0)
+				ready.push_back(i);
+		}
+		
+		std::mutex lock;
+		std::condition_variable finished;
+		size_t running = 0;
+		bool failed = false;
+		auto complete = [&](size_t i, bool success) {
+			if (success)
+				succeeded.emplace_back(list[i]);
+			else
+				failed = true;
+			if (!success && !reverse)
+				return; // dependents of a failed service never run
+			for (size_t next : unblocks[i]) {
+				if (--waitFor[next] == 0)
+					ready.push_back(next);
+			}
+		};
+		
+		if (lifecycleThreads <= 1 || list.size() <= 1) {
+			while (!ready.empty() && (reverse || !failed)) {
+				const size_t i = ready.front();
+				ready.pop_front();
+				complete(i, runService(*list[i], phase, action));
+			}
+			return !failed && succeeded.size() == list.size();
+		}
+		
+		FifoThreadPool<std::function<void()>> pool(std::min<size_t>(lifecycleThreads, list.size()));
+		pool.start();
+		{
+			std::unique_lock<std::mutex> lk(lock);
+			while (true) {
+				while (!ready.empty() && (reverse || !failed)) {
+					const size_t i = ready.front();
+					ready.pop_front();
+					running++;
+					pool.execute([&, i] {
+						const bool success = runService(*list[i], phase, action);
+						std::lock_guard<std::mutex> completionLock(lock);
+						complete(i, success);
+						running--;
+						finished.notify_one();
+					});
+				}
+				if (running == 0)
+					break;
+				finished.wait(lk);
+			}
+		}
+		pool.stop();
+		return !failed && succeeded.size() == list.size();
+	}
+
 };
 
 } // namespace jlcommon
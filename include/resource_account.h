@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace jlcommon {
+
+struct ResourceUsage {
+	uint64_t cpuNanoseconds = 0; // thread CPU time spent in accounted scopes
+	uint64_t intents = 0;        // intent handler invocations
+	uint64_t tasks = 0;          // other accounted tasks
+	uint64_t allocatedBytes = 0; // only if the application reports allocations, see ResourceAccount::recordAllocation
+	
+	inline ResourceUsage & operator+=(const ResourceUsage & other) noexcept {
+		cpuNanoseconds += other.cpuNanoseconds;
+		intents += other.intents;
+		tasks += other.tasks;
+		allocatedBytes += other.allocatedBytes;
+		return *this;
+	}
+};
+
+/**
+ * Resource usage of one service and, for a Manager, of everything below it
+ */
+struct ServiceResourceSnapshot {
+	std::string name;
+	ResourceUsage own;
+	ResourceUsage total; // own plus the totals of every child
+	std::vector<ServiceResourceSnapshot> children;
+};
+
+/**
+ * Accumulates the resources used on behalf of one service, from any number of threads
+ */
+class ResourceAccount {
+	public:
+	/**
+	 * Charges the calling thread's CPU time while alive to the account. Scopes nest: an inner scope pauses the outer
+	 * one, so no time is counted twice.
+	 */
+	class Scope {
+		public:
+		enum Kind {
+			INTENT,
+			TASK
+		};
+		
+		inline Scope(ResourceAccount & account, Kind kind) noexcept : mAccount(account), mPrevious(activeScope), mBegin(getThreadCpuNanoseconds()) {
+			if (mPrevious != nullptr)
+				mPrevious->pause(mBegin);
+			activeScope = this;
+			if (kind == INTENT)
+				account.mIntents.fetch_add(1, std::memory_order_relaxed);
+			else
+				account.mTasks.fetch_add(1, std::memory_order_relaxed);
+		}
+		inline ~Scope() {
+			const uint64_t end = getThreadCpuNanoseconds();
+			mAccount.mCpuNanoseconds.fetch_add(end - mBegin, std::memory_order_relaxed);
+			activeScope = mPrevious;
+			if (mPrevious != nullptr)
+				mPrevious->mBegin = end;
+		}
+		Scope(const Scope &) = delete;
+		Scope & operator=(const Scope &) = delete;
+		
+		private:
+		friend class ResourceAccount;
+		ResourceAccount & mAccount;
+		Scope * mPrevious;
+		uint64_t mBegin;
+		
+		inline void pause(uint64_t now) noexcept {
+			mAccount.mCpuNanoseconds.fetch_add(now - mBegin, std::memory_order_relaxed);
+		}
+	};
+	
+	[[nodiscard]] inline ResourceUsage getUsage() const noexcept {
+		ResourceUsage usage;
+		usage.cpuNanoseconds = mCpuNanoseconds.load(std::memory_order_relaxed);
+		usage.intents = mIntents.load(std::memory_order_relaxed);
+		usage.tasks = mTasks.load(std::memory_order_relaxed);
+		usage.allocatedBytes = mAllocatedBytes.load(std::memory_order_relaxed);
+		return usage;
+	}
+	
+	/**
+	 * Charges an allocation to the account of the innermost scope on the calling thread, if any. Meant to be called
+	 * from an application-provided operator new, so it never allocates itself.
+	 */
+	static inline void recordAllocation(size_t bytes) noexcept {
+		if (activeScope != nullptr)
+			activeScope->mAccount.mAllocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+	
+	static inline uint64_t getThreadCpuNanoseconds() noexcept {
+		struct timespec ts{};
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + static_cast<uint64_t>(ts.tv_nsec);
+	}
+	
+	private:
+	static inline thread_local Scope * activeScope = nullptr;
+	
+	std::atomic_uint64_t mCpuNanoseconds{0};
+	std::atomic_uint64_t mIntents{0};
+	std::atomic_uint64_t mTasks{0};
+	std::atomic_uint64_t mAllocatedBytes{0};
+};
+
+} // namespace jlcommon
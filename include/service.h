@@ -5,13 +5,79 @@
 #pragma once
 
 #include "intent_manager.h"
+#include "lifecycle_profile.h"
 
+#include <array>
 #include <string>
+#include <vector>
 #include <utility>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
 
 namespace jlcommon {
 
+enum class ServiceHealth : uint8_t {
+	OPERATIONAL,
+	DEGRADED, // still operational, but impaired
+	FAILED
+};
+
+/**
+ * Wakes whoever is waiting for the health of a group of services to change, and then the monitor of the enclosing
+ * group, if any
+ */
+class ServiceHealthMonitor {
+	public:
+	void notify() noexcept {
+		std::shared_ptr<ServiceHealthMonitor> parent;
+		{
+			std::lock_guard<std::mutex> lk(mLock);
+			mGeneration++;
+			parent = mParent;
+		}
+		mChanged.notify_all();
+		if (parent)
+			parent->notify();
+	}
+	
+	/**
+	 * Returns a token for wait(), to be taken before checking the health, so that a change in between is not missed
+	 */
+	[[nodiscard]] uint64_t getGeneration() const noexcept {
+		std::lock_guard<std::mutex> lk(mLock);
+		return mGeneration;
+	}
+	
+	void wait(uint64_t generation) {
+		std::unique_lock<std::mutex> lk(mLock);
+		mChanged.wait(lk, [&] { return mGeneration != generation; });
+	}
+	
+	/**
+	 * @return TRUE if notified since the generation was taken, FALSE on timeout
+	 */
+	template<typename Rep, typename Period>
+	bool waitFor(uint64_t generation, std::chrono::duration<Rep, Period> timeout) {
+		std::unique_lock<std::mutex> lk(mLock);
+		return mChanged.wait_for(lk, timeout, [&] { return mGeneration != generation; });
+	}
+	
+	void setParent(std::shared_ptr<ServiceHealthMonitor> parent) noexcept {
+		std::lock_guard<std::mutex> lk(mLock);
+		mParent = std::move(parent);
+	}
+	
+	private:
+	mutable std::mutex mLock;
+	std::condition_variable mChanged;
+	uint64_t mGeneration{0};
+	std::shared_ptr<ServiceHealthMonitor> mParent;
+};
+
 class Service {
 	public:
 	virtual ~Service() = default;
@@ -20,7 +86,10 @@ class Service {
 	
 	virtual bool start() { return true; }
 	
-	[[nodiscard]] virtual bool isOperational() const noexcept { return true; }
+	/**
+	 * Polled by the Manager, unless the service reports its health. By default, operational until reported FAILED.
+	 */
+	[[nodiscard]] virtual bool isOperational() const noexcept { return getHealth() != ServiceHealth::FAILED; }
 	
 	virtual bool stop() { return true; }
 	
@@ -28,29 +97,138 @@ class Service {
 	
 	[[nodiscard]] virtual std::string name() const noexcept { return "Service"; }
 	
+	/**
+	 * Names of the sibling services that must be initialized and started before this one, and stopped and terminated
+	 * after it
+	 */
+	[[nodiscard]] virtual std::vector<std::string> getDependencies() const { return {}; }
+	
+	/**
+	 * Returns TRUE if the service calls reportHealth() on every change, so that the Manager never needs to poll it
+	 */
+	[[nodiscard]] virtual bool reportsHealth() const noexcept { return false; }
+	
+	[[nodiscard]] virtual ServiceHealth getHealth() const noexcept { return mHealth.load(std::memory_order_acquire); }
+	
+	virtual void setHealthMonitor(std::shared_ptr<ServiceHealthMonitor> monitor) noexcept { std::atomic_store(&mHealthMonitor, std::move(monitor)); }
+	
 	[[nodiscard]] inline std::shared_ptr<IntentManager> getIntentManager() const noexcept { return mIntentManager; }
 	
 	virtual void setIntentManager(std::shared_ptr<IntentManager> intentManager) noexcept { this->mIntentManager = std::move(intentManager); }
 	
+	/**
+	 * Returns the resources charged to this service. Intent handlers subscribed through this service's subscribe()
+	 * helpers are charged to it, even if another service has the same name, but only while resource accounting is
+	 * enabled on the IntentManager.
+	 */
+	[[nodiscard]] virtual ServiceResourceSnapshot getResourceSnapshot() const {
+		const auto usage = mResourceAccount->getUsage();
+		return ServiceResourceSnapshot{name(), usage, usage, {}};
+	}
+	
+	/**
+	 * Returns how long the last run of each lifecycle phase took, as measured by the Manager running the service
+	 */
+	[[nodiscard]] virtual ServiceLifecycleProfile getLifecycleProfile() const {
+		std::lock_guard<std::mutex> lk(mLifecycleLock);
+		return ServiceLifecycleProfile{name(), mLifecycleTimings, {}};
+	}
+	
+	/**
+	 * Called by the Manager after each lifecycle phase of the service
+	 */
+	void recordLifecyclePhase(LifecyclePhase phase, const LifecyclePhaseTiming & timing) noexcept {
+		std::lock_guard<std::mutex> lk(mLifecycleLock);
+		mLifecycleTimings[static_cast<size_t>(phase)] = timing;
+	}
+	
 	protected:
+	/**
+	 * Records a change of health and immediately wakes the Manager, wherever it is waiting
+	 */
+	void reportHealth(ServiceHealth health) noexcept {
+		mHealth.store(health, std::memory_order_release);
+		auto monitor = std::atomic_load(&mHealthMonitor);
+		if (monitor)
+			monitor->notify();
+	}
+	
+	[[nodiscard]] inline const std::shared_ptr<ResourceAccount> & getResourceAccount() const noexcept { return mResourceAccount; }
+	
+	/**
+	 * Wraps a task that the service hands to a thread pool, so that its CPU time is charged to the service
+	 */
+	template<typename Task>
+	inline auto accounted(Task && task) const {
+		return [account = mResourceAccount, task = std::forward<Task>(task)]() mutable {
+			ResourceAccount::Scope scope(*account, ResourceAccount::Scope::TASK);
+			task();
+		};
+	}
+	
+	/**
+	 * Runs the task wherever this service's intent handlers run, never concurrently with them, charging it to the
+	 * service's ResourceAccount
+	 * @return FALSE if the service has no IntentManager yet
+	 */
+	bool execute(std::function<void()> task) {
+		if (!mIntentManager)
+			return false;
+		mIntentManager->post(name(), accounted(std::move(task)));
+		return true;
+	}
+	
+	/**
+	 * Runs the task once after the delay, like execute(). Returns an invalid handle if the service has no IntentManager yet.
+	 */
+	ScheduledTask schedule(std::chrono::milliseconds delay, std::function<void()> task) {
+		if (!mIntentManager)
+			return ScheduledTask{};
+		return mIntentManager->schedule(name(), delay, accounted(std::move(task)));
+	}
+	
+	/**
+	 * Runs the task periodically, like execute(), until the returned handle is cancelled
+	 */
+	ScheduledTask scheduleAtFixedRate(std::chrono::milliseconds initialDelay, std::chrono::milliseconds period, std::function<void()> task) {
+		if (!mIntentManager)
+			return ScheduledTask{};
+		return mIntentManager->scheduleAtFixedRate(name(), initialDelay, period, accounted(std::move(task)));
+	}
+	
 	template<typename Intent>
-	inline void subscribe(const std::shared_ptr<IntentManager>& intentManager, IntentCallback<Intent> && handler) {
-		intentManager->subscribe<Intent>(name(), handler);
+	inline IntentSubscription subscribe(const std::shared_ptr<IntentManager>& intentManager, IntentCallback<Intent> && handler) {
+		return intentManager->subscribe<Intent>(name(), handler, mResourceAccount);
 	}
 	
 	template<typename Intent>
-	inline void subscribe(const std::shared_ptr<IntentManager>& intentManager, const IntentCallback<Intent> & handler) {
-		intentManager->subscribe<Intent>(name(), handler);
+	inline IntentSubscription subscribe(const std::shared_ptr<IntentManager>& intentManager, const IntentCallback<Intent> & handler) {
+		return intentManager->subscribe<Intent>(name(), handler, mResourceAccount);
 	}
 	
 	template<typename Intent, typename ServiceName>
-	inline void subscribe(const std::shared_ptr<IntentManager>& intentManager, void(ServiceName::*function)(const Intent &)) {
-		intentManager->subscribe<Intent>(name(), std::bind(function, static_cast<ServiceName*>(this), std::placeholders::_1));
+	inline IntentSubscription subscribe(const std::shared_ptr<IntentManager>& intentManager, void(ServiceName::*function)(const Intent &)) {
+		return intentManager->subscribe<Intent>(name(), std::bind(function, static_cast<ServiceName*>(this), std::placeholders::_1), mResourceAccount);
+	}
+	
+	template<typename Intent>
+	inline IntentSubscription subscribeInline(const std::shared_ptr<IntentManager>& intentManager, const IntentCallback<Intent> & handler) {
+		return intentManager->subscribeInline<Intent>(name(), handler, mResourceAccount);
+	}
+	
+	template<typename Intent, typename ServiceName>
+	inline IntentSubscription subscribeInline(const std::shared_ptr<IntentManager>& intentManager, void(ServiceName::*function)(const Intent &)) {
+		return intentManager->subscribeInline<Intent>(name(), std::bind(function, static_cast<ServiceName*>(this), std::placeholders::_1), mResourceAccount);
 	}
 	
 	private:
 	std::shared_ptr<IntentManager> mIntentManager;
-	
+	std::shared_ptr<ServiceHealthMonitor> mHealthMonitor;
+	std::shared_ptr<ResourceAccount> mResourceAccount{std::make_shared<ResourceAccount>()};
+	std::atomic<ServiceHealth> mHealth{ServiceHealth::OPERATIONAL};
+	mutable std::mutex mLifecycleLock;
+	std::array<LifecyclePhaseTiming, LIFECYCLE_PHASE_COUNT> mLifecycleTimings{};
+
 };
 
 } // namespace jlcommon
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "intent_manager.h"
+#include "log.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace jlcommon {
+
+/**
+ * Broadcast ring buffer in a named POSIX shared-memory segment, which any number of processes can open to both publish
+ * and consume fixed-size messages. Every reader sees every message, as long as it keeps up: a writer never waits, it
+ * overwrites the oldest slot, and a reader that falls a full ring behind skips ahead and counts what it lost.
+ *
+ * Writing and reading are plain atomic operations on the mapping. A futex in the segment only comes into play when a
+ * reader has run out of messages and goes to sleep; until then writers leave the futex word alone, and while a reader
+ * sleeps they make a single wake-up call.
+ */
+class SharedMemoryRing {
+	public:
+	struct Message {
+		uint64_t origin;
+		uint32_t type;
+		uint32_t size;
+		const void * data; // 8-byte aligned, valid until the next read
+	};
+	
+	/**
+	 * Opens the segment, creating it if needed. Every process must use the same slot count and size.
+	 * @param name the shm_open name, e.g. "/my-bus"
+	 * @param slotCount number of messages the ring holds, a power of two
+	 * @param slotSize largest message, in bytes
+	 */
+	SharedMemoryRing(const std::string & name, uint32_t slotCount, uint32_t slotSize);
+	~SharedMemoryRing();
+	SharedMemoryRing(const SharedMemoryRing &) = delete;
+	SharedMemoryRing & operator=(const SharedMemoryRing &) = delete;
+	
+	[[nodiscard]] inline bool isOpen() const noexcept { return mHeader != nullptr; }
+	[[nodiscard]] inline uint32_t getSlotSize() const noexcept { return mSlotSize; }
+	
+	/**
+	 * Publishes a message. Only makes a system call if a reader is asleep.
+	 * @return FALSE if the ring is not open or the message is larger than a slot
+	 */
+	bool write(uint64_t origin, uint32_t type, const void * data, uint32_t size) noexcept;
+	
+	/**
+	 * Returns the sequence of the next message to be written, where a new reader starts
+	 */
+	[[nodiscard]] uint64_t getWriteSequence() const noexcept;
+	
+	/**
+	 * Reads the message at cursor, advancing the cursor past it
+	 * @param dropped incremented by the number of messages skipped because they were overwritten before being read
+	 * @return FALSE if no message is available yet
+	 */
+	bool read(uint64_t & cursor, Message & message, uint64_t & dropped) noexcept;
+	
+	/**
+	 * Waits until a message may be available at cursor, for at most timeoutMicroseconds
+	 */
+	void wait(uint64_t cursor, uint32_t timeoutMicroseconds) noexcept;
+	
+	/**
+	 * Wakes every sleeping reader, e.g. so that one can notice it is being stopped
+	 */
+	void wakeAll() noexcept;
+	
+	/**
+	 * Removes the segment name. Processes that still have it open keep working.
+	 */
+	static bool unlink(const std::string & name) noexcept;
+	
+	private:
+	struct Header;
+	struct Slot;
+	
+	Header * mHeader;
+	size_t mMappingSize;
+	uint32_t mSlotCount;
+	uint32_t mSlotSize;
+	size_t mSlotStride;
+	std::unique_ptr<uint64_t[]> mReadBuffer;
+	
+	Slot & getSlot(uint64_t sequence) const noexcept;
+	bool isReadable(uint64_t cursor) const noexcept;
+};
+
+/**
+ * Forwards selected intent types between the IntentManagers of processes on the same host, over a SharedMemoryRing.
+ * Intents broadcast locally are copied into the ring by an inline subscriber, and intents written by the other
+ * processes are broadcast locally from a receive thread. Only trivially copyable intents can be forwarded.
+ *
+ * Each type needs an identifier that is the same in every process, since type_info is not comparable across binaries.
+ */
+class SharedMemoryIntentBus {
+	public:
+	SharedMemoryIntentBus(std::shared_ptr<IntentManager> intentManager, const std::string & name, uint32_t slotCount = 4096, uint32_t slotSize = 256) :
+			mIntentManager(std::move(intentManager)),
+			mName(name),
+			mRing(std::make_shared<SharedMemoryRing>(name, slotCount, slotSize)),
+			mOrigin(createOrigin()) { }
+	~SharedMemoryIntentBus() {
+		stop();
+		std::lock_guard<std::mutex> lk(mForwardLock);
+		for (auto & subscription : mSubscriptions)
+			mIntentManager->unsubscribe(subscription);
+	}
+	SharedMemoryIntentBus(const SharedMemoryIntentBus &) = delete;
+	SharedMemoryIntentBus & operator=(const SharedMemoryIntentBus &) = delete;
+	
+	[[nodiscard]] inline bool isOpen() const noexcept { return mRing->isOpen(); }
+	
+	/**
+	 * Forwards T in both directions: local broadcasts are published to the other processes, and their broadcasts are
+	 * received here. Safe to call at any time, although intents received before the call are ignored.
+	 * @param type identifier of T on this bus, identical in every process
+	 * @return FALSE if T or the identifier is already forwarded, in which case nothing changes
+	 */
+	template<typename T>
+	bool forward(uint32_t type) {
+		static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable intents can be shared between processes");
+		static_assert(alignof(T) <= alignof(uint64_t), "intents are delivered from 8-byte aligned storage");
+		if (!mRing->isOpen() || sizeof(T) > mRing->getSlotSize()) {
+			Log::error("Unable to forward %s over shared memory bus %s", typeid(T).name(), mName.c_str());
+			return false;
+		}
+		std::lock_guard<std::mutex> lk(mForwardLock);
+		auto receivers = std::make_shared<ReceiverMap>(*std::atomic_load_explicit(&mReceivers, std::memory_order_acquire));
+		// A second subscription would publish every intent twice
+		if (mForwardedTypes.count(typeid(T)) != 0 || receivers->count(type) != 0) {
+			Log::error("%s or type %u is already forwarded over shared memory bus %s", typeid(T).name(), type, mName.c_str());
+			return false;
+		}
+		mForwardedTypes.emplace(typeid(T));
+		(*receivers)[type] = [intentManager = mIntentManager](const void * data) {
+			alignas(T) unsigned char storage[sizeof(T)];
+			std::memcpy(storage, data, sizeof(T));
+			intentManager->broadcast(T(*std::launder(reinterpret_cast<const T*>(storage))));
+		};
+		std::atomic_store_explicit(&mReceivers, std::shared_ptr<const ReceiverMap>(std::move(receivers)), std::memory_order_release);
+		
+		// The handler may still be running on a broadcasting thread after it is unsubscribed, so it shares the ring
+		// instead of using this bus, which only serves to recognize intents it received
+		mSubscriptions.emplace_back(mIntentManager->subscribeInline<T>("SharedMemoryIntentBus " + mName, [ring = mRing, origin = mOrigin, bus = this, type](const T & intent) {
+			if (receivingBus == bus)
+				return; // received from another process, don't echo it back
+			ring->write(origin, type, &intent, sizeof(T));
+		}));
+		return mSubscriptions.back().isValid();
+	}
+	
+	/**
+	 * Starts receiving intents published by other processes from this point on
+	 */
+	bool start() {
+		if (!mRing->isOpen() || mReceiveThread)
+			return false;
+		mRunning = true;
+		const uint64_t cursor = mRing->getWriteSequence();
+		mReceiveThread = std::make_unique<std::thread>([this, cursor] { receive(cursor); });
+		return true;
+	}
+	
+	void stop() {
+		if (!mReceiveThread)
+			return;
+		mRunning = false;
+		mRing->wakeAll();
+		mReceiveThread->join();
+		mReceiveThread.reset();
+	}
+	
+	/**
+	 * Returns how many messages this process missed because it fell a full ring behind
+	 */
+	[[nodiscard]] inline uint64_t getDroppedCount() const noexcept { return mDropped.load(std::memory_order_relaxed); }
+	
+	static inline bool unlink(const std::string & name) noexcept { return SharedMemoryRing::unlink(name); }
+	
+	private:
+	using ReceiverMap = std::unordered_map<uint32_t, std::function<void(const void *)>>;
+	
+	static constexpr uint32_t SPIN_READS = 1000;
+	static constexpr uint32_t WAIT_TIMEOUT_MICROSECONDS = 100000;
+	static inline thread_local const SharedMemoryIntentBus * receivingBus = nullptr;
+	
+	const std::shared_ptr<IntentManager> mIntentManager;
+	const std::string mName;
+	const std::shared_ptr<SharedMemoryRing> mRing; // unmapped once the last forwarding handler lets go of it
+	const uint64_t mOrigin;
+	std::mutex mForwardLock;
+	std::vector<IntentSubscription> mSubscriptions;
+	std::unordered_set<std::type_index> mForwardedTypes;
+	std::shared_ptr<const ReceiverMap> mReceivers{std::make_shared<ReceiverMap>()};
+	std::unique_ptr<std::thread> mReceiveThread;
+	std::atomic_bool mRunning{false};
+	std::atomic_uint64_t mDropped{0};
+	
+	void receive(uint64_t cursor) {
+		receivingBus = this;
+		uint64_t dropped = 0;
+		uint32_t idleReads = 0;
+		SharedMemoryRing::Message message{};
+		while (mRunning.load(std::memory_order_relaxed)) {
+			if (!mRing->read(cursor, message, dropped)) {
+				if (++idleReads >= SPIN_READS) {
+					mRing->wait(cursor, WAIT_TIMEOUT_MICROSECONDS);
+					idleReads = 0;
+				}
+				continue;
+			}
+			idleReads = 0;
+			if (dropped > 0) {
+				mDropped.fetch_add(dropped, std::memory_order_relaxed);
+				dropped = 0;
+			}
+			if (message.origin == mOrigin)
+				continue;
+			auto receivers = std::atomic_load_explicit(&mReceivers, std::memory_order_acquire);
+			auto receiver = receivers->find(message.type);
+			if (receiver != receivers->end())
+				receiver->second(message.data);
+		}
+		receivingBus = nullptr;
+	}
+	
+	static uint64_t createOrigin() noexcept;
+};
+
+} // namespace jlcommon
@@ -1,5 +1,10 @@
 #pragma once
 #include "blocking_queue.h"
+#include "trace.h"			// records task spans through libjlcommon, which users of this header must link
+#include "log.h"
+
+#include <pthread.h>
+#include <sched.h>
 
 #include <vector>		// std::vector
 #include <utility>		// std::pair, std::forward
@@ -12,15 +17,30 @@
 
 namespace jlcommon {
 
+/**
+ * Pins the calling thread to one CPU, logging a warning if that is refused
+ * @param role names the thread in the warning, e.g. "thread pool worker"
+ * @return FALSE if the thread could not be pinned
+ */
+inline bool pinCurrentThread(int cpu, const char * role) noexcept {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (error != 0)
+		Log::warn("Unable to pin %s to CPU %d, error=%d", role, cpu, error);
+	return error == 0;
+}
+
 template<typename T>
 class ThreadPool {
 	public:
 	explicit ThreadPool(unsigned int nThreads) :
-			mThreadCount(nThreads),
 			mThreads(nullptr),
 			mCriticalSection(false),
 			mStarted(false),
-			mThreadsStarted(0) { }
+			mThreadsStarted(0),
+			mThreadCount(nThreads) { }
 	
 	virtual ~ThreadPool() {
 		stop();
@@ -36,7 +56,7 @@ class ThreadPool {
 		mStarted = true;
 		mThreads = new std::thread*[mThreadCount];
 		for (unsigned int i = 0; i < mThreadCount; i++) {
-			mThreads[i] = new std::thread([this]{runWorker();});
+			mThreads[i] = new std::thread([this, i]{runWorker(i);});
 		}
 		
 		while (mThreadsStarted < mThreadCount) {
@@ -65,8 +85,18 @@ class ThreadPool {
 		mCriticalSection.clear();
 	}
 	
+	/**
+	 * Pins worker i to the CPU cpus[i % cpus.size()] from the next start(), e.g. to keep a latency-sensitive pool off
+	 * the cores of a busy one. Empty, the default, leaves placement to the scheduler.
+	 */
+	void setCpuAffinity(std::vector<int> cpus) {
+		while (!mCriticalSection.test_and_set());
+		mCpus = std::move(cpus);
+		mCriticalSection.clear();
+	}
+	
 	protected:
-	virtual void onCompleted(T && task) noexcept { }
+	virtual void onCompleted(T && task) noexcept { (void) task; }
 	virtual void runTask() noexcept = 0;
 	
 	private:
@@ -75,8 +105,11 @@ class ThreadPool {
 	std::atomic_bool mStarted;
 	std::atomic_uint mThreadsStarted;
 	unsigned int mThreadCount;
+	std::vector<int> mCpus;
 	
-	void runWorker() {
+	void runWorker(unsigned int index) {
+		if (!mCpus.empty())
+			pinCurrentThread(mCpus[index % mCpus.size()], "thread pool worker");
 		mThreadsStarted.fetch_add(1);
 		while (mStarted) {
 			runTask();
@@ -113,7 +146,10 @@ class FifoThreadPool : public ThreadPool<T> {
 	void runTask() noexcept override {
 		T task;
 		if (mQueue.take(task, [](){ return false; })) {
-			task();
+			{
+				Trace::Span span("FifoThreadPool", "task");
+				task();
+			}
 			this->onCompleted(std::move(task));
 		}
 	}
@@ -180,12 +216,16 @@ class ScheduledThreadPool : public ThreadPool<SchedulingInfo<T>> {
 	}
 	
 	virtual void start() {
+		mLock.lock();
 		mRunning = true;
+		mLock.unlock();
 		ThreadPool<SchedulingInfo<T>>::start();
 	}
 	
 	virtual void stop() {
+		mLock.lock();
 		mRunning = false;
+		mLock.unlock();
 		mCondition.notify_all();
 		ThreadPool<SchedulingInfo<T>>::stop();
 	}
@@ -239,11 +279,15 @@ class ScheduledThreadPool : public ThreadPool<SchedulingInfo<T>> {
 				lk.unlock();
 				mCondition.notify_one();
 				// Run
-				task();
+				{
+					Trace::Span span("ScheduledThreadPool", "task");
+					task();
+				}
 				onCompleted(std::move(task));
 				return;
 			}
-			mCondition.wait_until(lk, mQueue.begin()->nextExecution, [this]{return !mRunning; });
+			const auto nextExecution = mQueue.begin()->nextExecution; // the queue may be reallocated while waiting
+			mCondition.wait_until(lk, nextExecution, [this]{return !mRunning; });
 			if (mQueue.empty())
 				mCondition.wait(lk, [this]{return !mRunning || !mQueue.empty(); });
 			if (!mRunning || mQueue.empty())
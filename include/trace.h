@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace jlcommon {
+
+/**
+ * Opt-in execution tracer. Spans are recorded into per-thread ring buffers without locking and can be exported as
+ * Chrome trace-event JSON, which loads in Perfetto or chrome://tracing. While disabled, a span costs one relaxed load.
+ */
+namespace Trace {
+
+namespace Internal {
+extern std::atomic_bool enabled;
+} // namespace Internal
+
+/**
+ * Starts recording. Each thread that records keeps at most eventsPerThread of its most recent spans; a thread that
+ * already recorded starts a buffer of the new size with its next span, keeping the spans it had until then. When a
+ * thread exits its buffer is released, and its spans are kept with those of other exited threads, up to eventsPerThread
+ * in total, dropping the threads that exited first.
+ */
+void enable(size_t eventsPerThread = 65536);
+void disable();
+/**
+ * Discards all recorded spans, including those of exited threads. Should only be called while disabled.
+ */
+void clear();
+
+inline bool isEnabled() noexcept {
+	return Internal::enabled.load(std::memory_order_relaxed);
+}
+
+inline uint64_t now() noexcept {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Records a completed span on the calling thread
+ * @param category a string literal grouping the span, e.g. "intent"
+ * @param name what ran, copied into the event
+ * @param detail optional second part of the name, e.g. the subscriber, or nullptr
+ */
+void record(const char * category, const char * name, const char * detail, uint64_t beginNanoseconds, uint64_t endNanoseconds) noexcept;
+
+/**
+ * Returns every recorded span as Chrome trace-event JSON. For a consistent result, disable tracing first.
+ */
+std::string getChromeTraceJson();
+bool dumpChromeTrace(const std::string & path);
+
+/**
+ * Records the lifetime of the object as a span, if tracing was enabled when it was created
+ */
+class Span {
+	public:
+	inline Span(const char * category, const char * name, const char * detail = nullptr) noexcept :
+			mCategory(category),
+			mName(name),
+			mDetail(detail),
+			mBegin(isEnabled() ? now() : 0) { }
+	inline ~Span() {
+		if (mBegin != 0)
+			record(mCategory, mName, mDetail, mBegin, now());
+	}
+	Span(const Span &) = delete;
+	Span & operator=(const Span &) = delete;
+	
+	private:
+	const char * mCategory;
+	const char * mName;
+	const char * mDetail;
+	uint64_t mBegin;
+};
+
+} // namespace Trace
+
+} // namespace jlcommon
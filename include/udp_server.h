@@ -1,34 +1,198 @@
 #pragma once
 #include "inet_address.h"
+#include "intent_pool.h"
+#include <sys/socket.h>
 #include <string>
 #include <thread>
 #include <functional>
 #include <utility>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
 
 namespace jlcommon {
 
+class EventLoop;
+class IoUring;
+
+/**
+ * One received datagram. Everything it points to is only valid for the duration of the handler call.
+ */
+struct UdpDatagram {
+	const char * data;
+	size_t length;
+	const struct sockaddr * address; // the sender
+	socklen_t addressLength;
+	bool truncated;                  // larger than UdpServerConfig::maxDatagramSize, so the rest was discarded
+};
+
+/**
+ * A received datagram in a buffer of its own. Packets come from a pool and return to it once the last shared_ptr is
+ * dropped, so a handler can keep one, hand it to another thread or broadcast it (IntentManager::broadcastShared)
+ * without copying the payload or allocating.
+ */
+struct UdpPacket {
+	std::unique_ptr<char[]> buffer;
+	size_t capacity = 0;
+	size_t length = 0;
+	struct sockaddr_storage address{};
+	socklen_t addressLength = 0;
+	bool truncated = false;
+	
+	[[nodiscard]] inline const char * data() const noexcept { return buffer.get(); }
+	[[nodiscard]] inline const struct sockaddr * getAddress() const noexcept { return reinterpret_cast<const struct sockaddr *>(&address); }
+};
+
 using UdpServerHandler = std::function<void(const char * buffer, size_t len)>;
+using UdpServerBatchHandler = std::function<void(const UdpDatagram * datagrams, size_t count)>;
+using UdpPacketHandler = std::function<void(std::shared_ptr<UdpPacket> packet)>;
+
+/**
+ * Datagrams to many destinations, sent together by UdpServer::send(UdpSendBatch &) with as few sendmmsg calls as
+ * possible. Payloads are not copied: they must stay valid until the batch is sent. A batch can be cleared and refilled
+ * without allocating again.
+ */
+class UdpSendBatch {
+	public:
+	static constexpr size_t MAX_SEGMENTS = 64;           // per segmented datagram, the kernel's limit
+	static constexpr size_t MAX_SEGMENTED_SIZE = 65507;  // the largest UDP payload over IPv4
+	
+	explicit UdpSendBatch(size_t capacity = 64) {
+		mEntries.reserve(capacity);
+	}
+	
+	inline void add(InetAddress & addr, const void * buffer, size_t len) {
+		addEntry(addr, buffer, len, 0);
+	}
+	
+	/**
+	 * Queues a payload that the kernel splits into datagrams of segmentSize bytes (the last one may be shorter) with
+	 * UDP_SEGMENT, so the whole payload costs a single trip through the network stack. Where segmentation offload is
+	 * unavailable, the datagrams are sent one by one instead.
+	 * @return FALSE if the payload needs more than MAX_SEGMENTS datagrams or exceeds MAX_SEGMENTED_SIZE
+	 */
+	inline bool addSegmented(InetAddress & addr, const void * buffer, size_t len, uint16_t segmentSize) {
+		if (segmentSize == 0 || len > MAX_SEGMENTED_SIZE || (len + segmentSize - 1) / segmentSize > MAX_SEGMENTS)
+			return false;
+		addEntry(addr, buffer, len, (len > segmentSize) ? segmentSize : 0);
+		return true;
+	}
+	
+	inline void clear() noexcept {
+		mEntries.clear();
+		mResults.clear();
+	}
+	
+	[[nodiscard]] inline size_t size() const noexcept { return mEntries.size(); }
+	[[nodiscard]] inline bool empty() const noexcept { return mEntries.empty(); }
+	
+	/**
+	 * Returns the outcome of each queued datagram after a send, in the order they were added: the number of bytes sent,
+	 * or a negated errno
+	 */
+	[[nodiscard]] inline const std::vector<ssize_t> & getResults() const noexcept { return mResults; }
+	
+	private:
+	friend class UdpServer;
+	
+	struct Entry {
+		const void * data;
+		size_t length;
+		uint16_t segmentSize; // 0 unless segmented
+		struct sockaddr_storage address;
+		socklen_t addressLength;
+	};
+	
+	std::vector<Entry> mEntries;
+	std::vector<ssize_t> mResults;
+	std::vector<struct mmsghdr> mMessages;
+	std::vector<struct iovec> mVectors;
+	std::vector<char> mControl;
+	
+	void addEntry(InetAddress & addr, const void * buffer, size_t len, uint16_t segmentSize);
+	/**
+	 * Builds the sendmmsg headers for every entry, once the entries no longer move
+	 */
+	void prepare();
+};
+
+struct UdpServerConfig {
+	/**
+	 * Datagrams read per recvmmsg call. Each wake-up keeps reading batches until the socket is drained, so at high
+	 * packet rates the system call cost is shared by up to this many datagrams.
+	 */
+	size_t receiveBatch = 1;
+	size_t maxDatagramSize = 1500;
+	/**
+	 * Sockets bound to the same port with SO_REUSEPORT, each read by its own thread, so that receiving scales with
+	 * cores. The kernel spreads datagrams across them by their 4-tuple, and the handlers are called concurrently.
+	 */
+	size_t shards = 1;
+	/**
+	 * If not empty, the reader of shard i is pinned to the CPU shardCpus[i % shardCpus.size()]
+	 */
+	std::vector<int> shardCpus;
+	/**
+	 * Attaches a BPF program that picks the shard from the sender's IP address alone, so every datagram from a host
+	 * reaches the same shard whichever port it uses, and the mapping does not depend on the kernel's hash
+	 */
+	bool steerByPeerAddress = false;
+	/**
+	 * Idle packets each shard keeps for reuse, with a packet handler
+	 */
+	size_t maxIdlePackets = 1024;
+	/**
+	 * Receives and sends batches through io_uring instead of poll, recvmmsg and sendmmsg. Each shard keeps a multishot
+	 * receive posted with a ring of provided buffers, so a busy socket delivers datagrams without a system call per
+	 * batch, and its reader only enters the kernel to wait. Where io_uring, or one of the operations it needs, is
+	 * unavailable the server uses the plain system calls, as does a reader whose ring fails later on. Packet handlers get a copy of the payload, since the ring's buffers are recycled in place.
+	 */
+	bool useIoUring = false;
+	/**
+	 * Provided buffers per shard with io_uring, at most 65536. Datagrams beyond what they hold wait in the socket.
+	 */
+	unsigned ioUringBuffers = 256;
+	/**
+	 * If set, every shard's socket is watched by this loop, whose threads call the handlers, instead of by a thread of
+	 * its own. Receiving through io_uring and shardCpus then do not apply.
+	 */
+	std::shared_ptr<EventLoop> eventLoop;
+};
 
 class UdpServer {
 	public:
 	inline UdpServer() : UdpServer(0) {}
 	explicit inline UdpServer(int port) : UdpServer(nullptr, port) {}
+	inline UdpServer(int port, const UdpServerConfig & config) : UdpServer(InetAddress::getByName(nullptr, port), config) {}
 	inline UdpServer(const std::string& host, int port) : UdpServer(host.c_str(), port) {}
 	inline UdpServer(const char * host, int port) : UdpServer(InetAddress::getByName(host, port)) {}
-	explicit UdpServer(const InetAddress& bindAddress) :
-			mBindAddress   {new InetAddress(bindAddress)},
-			mReadThread    {},
-			mReadHandler   {[](auto buf, auto len){ (void)buf; (void)len; }},
-			mSockfd        {-1},
-			mReadBuffer    {new char[1500]},
-			mReadBufferSize{1500} {
-		start();
-	}
+	explicit inline UdpServer(const InetAddress& bindAddress) : UdpServer(bindAddress, UdpServerConfig{}) {}
+	UdpServer(const InetAddress& bindAddress, const UdpServerConfig & config);
 	~UdpServer();
 	
+	/**
+	 * Handlers may be replaced while the server runs; each reader picks up the change with its next batch
+	 */
 	inline void setHandler(UdpServerHandler handler) {
-		mReadHandler = std::move(handler);
+		updateHandlers([&](Handlers & handlers){ handlers.read = std::move(handler); });
+	}
+	
+	/**
+	 * Receives every batch read from the socket in one call, instead of one handler call per datagram
+	 */
+	inline void setBatchHandler(UdpServerBatchHandler handler) {
+		updateHandlers([&](Handlers & handlers){ handlers.batch = std::move(handler); });
+	}
+	
+	/**
+	 * Receives each datagram directly into a pooled UdpPacket that the handler owns, instead of a buffer reused as soon
+	 * as the handler returns. Takes precedence over the other handlers.
+	 */
+	inline void setPacketHandler(UdpPacketHandler handler) {
+		updateHandlers([&](Handlers & handlers){ handlers.packet = std::move(handler); });
 	}
 	
 	inline auto getPort() {
@@ -39,21 +203,86 @@ class UdpServer {
 		return mSockfd;
 	}
 	
+	[[nodiscard]] inline size_t getShardCount() const noexcept {
+		return mShards.size();
+	}
+	
+	/**
+	 * Returns TRUE if useIoUring was asked for and the kernel provided it
+	 */
+	[[nodiscard]] bool isUsingIoUring() const;
+	
+	/**
+	 * Returns the number of released packets waiting in the pools to be received into again
+	 */
+	[[nodiscard]] size_t getIdlePacketCount() const;
+	
 	inline int send(InetAddress & addr, const void * buffer, size_t len) { return send(addr, buffer, len, 0); }
 	int send(InetAddress & addr, const void * buffer, size_t len, int flags);
+	/**
+	 * Sends every datagram of the batch, continuing past any that fail
+	 * @return the number of entries sent successfully, see UdpSendBatch::getResults() for each one
+	 */
+	size_t send(UdpSendBatch & batch, int flags = 0);
 	void setBroadcast(int enabled);
 	
 	private:
+	struct Shard;
+	struct Handlers {
+		UdpServerHandler read;
+		UdpServerBatchHandler batch;
+		UdpPacketHandler packet;
+	};
+	
 	InetAddress * mBindAddress;
-	std::unique_ptr<std::thread> mReadThread;
-	UdpServerHandler mReadHandler;
-	int mSockfd;
-	char * mReadBuffer;
-	size_t mReadBufferSize;
+	std::shared_ptr<const Handlers> mHandlers; // replaced whole, so readers take one consistent set per batch
+	std::mutex mHandlerLock;                   // serializes the replacements
+	int mSockfd; // of the first shard, which also sends
+	std::atomic_bool mRunning;
+	const UdpServerConfig mConfig;
+	std::vector<std::unique_ptr<Shard>> mShards;
+	std::atomic_bool mSegmentationSupported;
+	std::unique_ptr<IoUring> mSendRing;
+	mutable std::mutex mSendLock; // the send ring has a single submission queue
+	
+	template<typename Update>
+	void updateHandlers(Update && update) {
+		std::lock_guard<std::mutex> lk(mHandlerLock);
+		auto handlers = std::make_shared<Handlers>(*std::atomic_load_explicit(&mHandlers, std::memory_order_acquire));
+		update(*handlers);
+		std::atomic_store_explicit(&mHandlers, std::shared_ptr<const Handlers>(std::move(handlers)), std::memory_order_release);
+	}
 	
 	void start();
 	void stop();
-	void read();
+	int openSocket(bool reusePort);
+	bool attachSteeringProgram();
+	bool openRings();
+	void read(Shard & shard);
+	void readRing(Shard & shard);
+	/**
+	 * Takes the multishot receive off the socket and closes the shard's ring, once the reader falls back to poll
+	 */
+	void cancelReceive(Shard & shard);
+	bool postReceive(Shard & shard);
+	bool postWakeUp(Shard & shard);
+	/**
+	 * Reads batches until the socket has nothing left
+	 * @return FALSE if the socket failed
+	 */
+	bool receiveAvailable(Shard & shard);
+	void dispatch(Shard & shard, size_t count, const Handlers & handlers);
+	void dispatchPackets(Shard & shard, size_t count, const Handlers & handlers);
+	/**
+	 * Hands the first count entries of the shard's datagrams to the handlers
+	 */
+	void deliver(Shard & shard, size_t count, const Handlers & handlers);
+	size_t sendThroughRing(UdpSendBatch & batch, int flags);
+	/**
+	 * Sends a segmented entry as individual datagrams
+	 * @return the number of bytes sent, or a negated errno
+	 */
+	ssize_t sendSegments(const UdpSendBatch::Entry & entry, int flags);
 };
 
 } // namespace jlcommon
@@ -0,0 +1,236 @@
+#include <event_loop.h>
+
+#include <log.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <future>
+
+namespace jlcommon {
+
+namespace {
+
+constexpr int MAX_EVENTS = 64;
+
+thread_local const void * currentLoop = nullptr;
+
+struct timespec toTimespec(std::chrono::milliseconds duration) {
+	struct timespec time{};
+	time.tv_sec = static_cast<time_t>(duration.count() / 1000);
+	time.tv_nsec = static_cast<long>((duration.count() % 1000) * 1000000);
+	return time;
+}
+
+} // namespace
+
+EventLoop::EventLoop(size_t threads) : mWorkers{}, mRunning{true}, mLock{}, mSources{}, mNextId{1}, mNextPost{0} {
+	if (threads == 0)
+		threads = 1;
+	for (size_t i = 0; i < threads; i++) {
+		auto worker = std::make_unique<Worker>();
+		worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+		worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		struct epoll_event event{};
+		event.events = EPOLLIN | EPOLLET;
+		event.data.ptr = nullptr; // the wake-up
+		if (worker->epollFd == -1 || worker->wakeFd == -1 || epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &event) == -1) {
+			Log::error("EventLoop: unable to create a loop thread, errno=%d", errno);
+			if (worker->epollFd != -1)
+				close(worker->epollFd);
+			if (worker->wakeFd != -1)
+				close(worker->wakeFd);
+			continue;
+		}
+		mWorkers.emplace_back(std::move(worker));
+	}
+	for (auto & worker : mWorkers) {
+		Worker * w = worker.get();
+		w->thread = std::thread([this, w]{run(*w);});
+	}
+}
+
+EventLoop::~EventLoop() {
+	mRunning = false;
+	for (auto & worker : mWorkers)
+		eventfd_write(worker->wakeFd, 1);
+	for (auto & worker : mWorkers) {
+		worker->thread.join();
+		close(worker->epollFd);
+		close(worker->wakeFd);
+	}
+	for (auto & entry : mSources) {
+		Source * source = entry.second.second;
+		if (source->task)
+			close(source->fd);
+		delete source;
+	}
+}
+
+uint64_t EventLoop::add(int fd, uint32_t events, Handler handler) {
+	return addSource(fd, events, new Source{0, fd, std::move(handler), {}, false, true});
+}
+
+uint64_t EventLoop::addTimer(std::chrono::milliseconds delay, std::chrono::milliseconds period, Task task) {
+	const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		Log::error("EventLoop: timerfd_create failed, errno=%d", errno);
+		return 0;
+	}
+	struct itimerspec spec{};
+	spec.it_value = toTimespec(delay);
+	if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+		spec.it_value.tv_nsec = 1; // zero would disarm it
+	spec.it_interval = toTimespec(period);
+	const uint64_t id = addSource(fd, EPOLLIN, new Source{0, fd, {}, std::move(task), period.count() > 0, true});
+	if (id == 0) {
+		close(fd);
+		return 0;
+	}
+	if (timerfd_settime(fd, 0, &spec, nullptr) == -1) {
+		Log::error("EventLoop: timerfd_settime failed, errno=%d", errno);
+		remove(id);
+		return 0;
+	}
+	return id;
+}
+
+uint64_t EventLoop::addSource(int fd, uint32_t events, Source * source) {
+	if (mWorkers.empty()) {
+		delete source;
+		return 0;
+	}
+	Worker * worker = mWorkers.front().get();
+	for (auto & candidate : mWorkers) {
+		if (candidate->sourceCount < worker->sourceCount)
+			worker = candidate.get();
+	}
+	{
+		std::lock_guard<std::mutex> guard(mLock);
+		source->id = mNextId++;
+		mSources.emplace(source->id, std::make_pair(worker, source));
+	}
+	worker->sourceCount++;
+	struct epoll_event event{};
+	event.events = events | EPOLLET;
+	event.data.ptr = source;
+	if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		Log::error("EventLoop: unable to watch fd %d, errno=%d", fd, errno);
+		std::lock_guard<std::mutex> guard(mLock);
+		mSources.erase(source->id);
+		worker->sourceCount--;
+		delete source;
+		return 0;
+	}
+	return source->id;
+}
+
+void EventLoop::remove(uint64_t id) {
+	Worker * worker;
+	Source * source;
+	{
+		std::lock_guard<std::mutex> guard(mLock);
+		auto it = mSources.find(id);
+		if (it == mSources.end())
+			return;
+		worker = it->second.first;
+		source = it->second.second;
+		mSources.erase(it);
+	}
+	runOn(*worker, [this, worker, source]{ detach(*worker, source); });
+}
+
+void EventLoop::detach(Worker & worker, Source * source) {
+	epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, source->fd, nullptr);
+	if (source->task)
+		close(source->fd);
+	source->active = false; // its events may still be waiting in the current batch
+	worker.retired.emplace_back(source);
+	worker.sourceCount--;
+}
+
+void EventLoop::post(Task task) {
+	if (mWorkers.empty())
+		return;
+	Worker & worker = *mWorkers[mNextPost++ % mWorkers.size()];
+	{
+		std::lock_guard<std::mutex> guard(worker.lock);
+		worker.tasks.emplace_back(std::move(task));
+	}
+	eventfd_write(worker.wakeFd, 1);
+}
+
+bool EventLoop::isInLoopThread() const noexcept {
+	return currentLoop == this;
+}
+
+void EventLoop::runOn(Worker & worker, Task task) {
+	if (std::this_thread::get_id() == worker.thread.get_id() || !mRunning) {
+		task(); // no loop thread left to run it once stopped
+		return;
+	}
+	std::promise<void> done;
+	auto future = done.get_future();
+	{
+		std::lock_guard<std::mutex> guard(worker.lock);
+		worker.tasks.emplace_back([&task, &done]{
+			task();
+			done.set_value();
+		});
+	}
+	eventfd_write(worker.wakeFd, 1);
+	future.wait();
+}
+
+void EventLoop::runTasks(Worker & worker) {
+	std::vector<Task> tasks;
+	{
+		std::lock_guard<std::mutex> guard(worker.lock);
+		tasks.swap(worker.tasks);
+	}
+	for (auto & task : tasks)
+		task();
+}
+
+void EventLoop::dispatch(Source & source, uint32_t events) {
+	if (!source.task) {
+		source.handler(events);
+		return;
+	}
+	uint64_t expirations;
+	if (read(source.fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return; // re-armed since it became readable
+	source.task();
+	if (!source.periodic && source.active)
+		remove(source.id);
+}
+
+void EventLoop::run(Worker & worker) {
+	currentLoop = this;
+	struct epoll_event events[MAX_EVENTS];
+	while (mRunning) {
+		const int n = epoll_wait(worker.epollFd, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			Log::error("EventLoop: epoll_wait failed, errno=%d", errno);
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			auto source = static_cast<Source *>(events[i].data.ptr);
+			if (source == nullptr) {
+				eventfd_t value;
+				eventfd_read(worker.wakeFd, &value);
+				runTasks(worker);
+			} else if (source->active) {
+				dispatch(*source, events[i].events);
+			}
+		}
+		worker.retired.clear();
+	}
+	runTasks(worker); // release whoever waits in remove()
+}
+
+} // namespace jlcommon
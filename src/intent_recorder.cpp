@@ -0,0 +1,157 @@
+#include <intent_recorder.h>
+#include <log.h>
+
+#include <thread>
+
+namespace jlcommon {
+
+namespace IntentRecorderHelper {
+
+namespace {
+
+constexpr char RECORDING_MAGIC[8] = {'J', 'L', 'C', 'I', 'N', 'T', 'R', '1'};
+
+size_t encodeVarint(uint64_t value, unsigned char * out) {
+	size_t length = 0;
+	while (value >= 0x80) {
+		out[length++] = static_cast<unsigned char>(value | 0x80);
+		value >>= 7;
+	}
+	out[length++] = static_cast<unsigned char>(value);
+	return length;
+}
+
+} // namespace
+
+RecordingWriter::~RecordingWriter() {
+	close();
+}
+
+bool RecordingWriter::open(const std::string & path) {
+	std::lock_guard<std::mutex> lk(mLock);
+	mOpen.store(false, std::memory_order_release);
+	if (mFile != nullptr)
+		fclose(mFile);
+	mFile = fopen(path.c_str(), "wb");
+	if (mFile == nullptr || fwrite(RECORDING_MAGIC, sizeof(RECORDING_MAGIC), 1, mFile) != 1) {
+		Log::error("Unable to create intent recording %s", path.c_str());
+		if (mFile != nullptr)
+			fclose(mFile);
+		mFile = nullptr;
+		return false;
+	}
+	mPrevious = std::chrono::steady_clock::now();
+	mRecordCount = 0;
+	mOpen.store(true, std::memory_order_release);
+	return true;
+}
+
+void RecordingWriter::close() {
+	std::lock_guard<std::mutex> lk(mLock);
+	mOpen.store(false, std::memory_order_release);
+	if (mFile != nullptr) {
+		fclose(mFile);
+		mFile = nullptr;
+	}
+}
+
+void RecordingWriter::write(uint32_t type, const void * data, size_t size) noexcept {
+	unsigned char header[30];
+	std::lock_guard<std::mutex> lk(mLock);
+	if (mFile == nullptr)
+		return; // closed since the caller checked isOpen()
+	// Timestamps are taken under the lock, so that deltas are never negative
+	const auto now = std::chrono::steady_clock::now();
+	size_t length = encodeVarint(std::chrono::duration_cast<std::chrono::nanoseconds>(now - mPrevious).count(), header);
+	length += encodeVarint(type, header + length);
+	length += encodeVarint(size, header + length);
+	mPrevious = now;
+	fwrite(header, 1, length, mFile);
+	fwrite(data, 1, size, mFile);
+	mRecordCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+RecordingReader::~RecordingReader() {
+	if (mFile != nullptr)
+		fclose(mFile);
+}
+
+bool RecordingReader::open(const std::string & path) {
+	char magic[sizeof(RECORDING_MAGIC)];
+	mFile = fopen(path.c_str(), "rb");
+	if (mFile == nullptr || fread(magic, sizeof(magic), 1, mFile) != 1 || memcmp(magic, RECORDING_MAGIC, sizeof(magic)) != 0) {
+		Log::error("Unable to open intent recording %s", path.c_str());
+		return false;
+	}
+	const long start = ftell(mFile);
+	long end = -1;
+	if (fseek(mFile, 0, SEEK_END) == 0)
+		end = ftell(mFile);
+	if (end < start || fseek(mFile, start, SEEK_SET) != 0) {
+		Log::error("Unable to read the size of intent recording %s", path.c_str());
+		return false;
+	}
+	mFileSize = static_cast<uint64_t>(end);
+	return true;
+}
+
+bool RecordingReader::next(uint64_t & delay, uint32_t & type, std::string & payload) {
+	uint64_t type64;
+	uint64_t size;
+	if (!readVarint(delay) || !readVarint(type64) || !readVarint(size) || type64 > UINT32_MAX)
+		return false;
+	type = static_cast<uint32_t>(type64);
+	const long position = ftell(mFile);
+	if (size > MAX_PAYLOAD_SIZE || position < 0 || size > mFileSize - static_cast<uint64_t>(position)) {
+		Log::error("Intent recording is corrupt: a record of type %u claims %llu bytes", type, static_cast<unsigned long long>(size));
+		return false;
+	}
+	payload.resize(size);
+	return size == 0 || fread(&payload[0], size, 1, mFile) == 1;
+}
+
+bool RecordingReader::readVarint(uint64_t & value) {
+	value = 0;
+	for (unsigned int shift = 0; shift < 64; shift += 7) {
+		const int byte = fgetc(mFile);
+		if (byte == EOF)
+			return false;
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+} // namespace IntentRecorderHelper
+
+uint64_t IntentReplayer::run(const std::string & path, double speed) {
+	IntentRecorderHelper::RecordingReader reader;
+	if (!reader.open(path))
+		return 0;
+	
+	uint64_t broadcasts = 0;
+	uint64_t delay;
+	uint32_t type;
+	std::string payload;
+	double elapsed = 0; // nanoseconds into the recording
+	const auto start = std::chrono::steady_clock::now();
+	while (!mStopped && reader.next(delay, type, payload)) {
+		if (speed > 0)
+			elapsed += static_cast<double>(delay) / speed; // skipped records still take their time
+		auto decoder = mDecoders.find(type);
+		if (decoder == mDecoders.end())
+			continue;
+		if (speed > 0)
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<int64_t>(elapsed)));
+		try {
+			decoder->second(payload);
+			broadcasts++;
+		} catch (const std::exception &e) {
+			Log::error("Unable to replay intent of type %u. %s", type, e.what());
+		}
+	}
+	return broadcasts;
+}
+
+} // namespace jlcommon
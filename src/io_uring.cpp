@@ -0,0 +1,244 @@
+#include <io_uring.h>
+
+#include <log.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace jlcommon {
+
+#if JLCOMMON_IO_URING
+
+namespace {
+
+int setup(unsigned entries, io_uring_params & params) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+}
+
+int enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int registerRing(int fd, unsigned opcode, void * arg, unsigned count) {
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+template<typename T>
+T * at(void * base, uint32_t offset) {
+	return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+}
+
+} // namespace
+
+IoUring::IoUring(unsigned entries, bool singleIssuer, unsigned completions) :
+		mFd{-1}, mDisabled{false}, mSqEntries{0}, mSqTail{0}, mSqSubmitted{0}, mSqHead{nullptr}, mSqTailShared{nullptr}, mSqMask{0},
+		mSqes{nullptr}, mCqHead{nullptr}, mCqTail{nullptr}, mCqMask{0}, mCqes{nullptr}, mSqRing{MAP_FAILED},
+		mSqRingSize{0}, mCqRing{MAP_FAILED}, mCqRingSize{0}, mSqesSize{0}, mSupported{} {
+	io_uring_params params{};
+	const unsigned sizing = (completions > 0) ? IORING_SETUP_CQSIZE : 0;
+	params.cq_entries = std::max(completions, entries);
+	if (singleIssuer) {
+		params.flags = sizing | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+		mFd = setup(entries, params);
+		mDisabled = (mFd != -1);
+		if (mFd == -1 && errno == EINVAL) { // kernels before 6.1
+			params = {};
+			params.cq_entries = std::max(completions, entries);
+		}
+	}
+	if (mFd == -1) {
+		params.flags = sizing;
+		mFd = setup(entries, params);
+	}
+	if (mFd == -1) {
+		Log::warn("io_uring is unavailable, errno=%d", errno);
+		return;
+	}
+	
+	mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMap)
+		mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+	mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+	if (mSqRing != MAP_FAILED)
+		mCqRing = singleMap ? mSqRing : mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+	mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void * sqes = (mCqRing == MAP_FAILED) ? MAP_FAILED : mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		Log::error("io_uring: unable to map the rings, errno=%d", errno);
+		close();
+		return;
+	}
+	
+	mSqEntries = params.sq_entries;
+	mSqHead = at<unsigned>(mSqRing, params.sq_off.head);
+	mSqTailShared = at<unsigned>(mSqRing, params.sq_off.tail);
+	mSqMask = *at<unsigned>(mSqRing, params.sq_off.ring_mask);
+	mSqes = static_cast<io_uring_sqe *>(sqes);
+	mSqTail = mSqSubmitted = *mSqTailShared;
+	auto array = at<unsigned>(mSqRing, params.sq_off.array);
+	for (unsigned i = 0; i < mSqEntries; i++)
+		array[i] = i; // entries are always used in ring order
+	mCqHead = at<unsigned>(mCqRing, params.cq_off.head);
+	mCqTail = at<unsigned>(mCqRing, params.cq_off.tail);
+	mCqMask = *at<unsigned>(mCqRing, params.cq_off.ring_mask);
+	mCqes = at<io_uring_cqe>(mCqRing, params.cq_off.cqes);
+	probe();
+}
+
+IoUring::~IoUring() {
+	close();
+}
+
+void IoUring::close() noexcept {
+	if (mSqes != nullptr)
+		munmap(mSqes, mSqesSize);
+	if (mCqRing != MAP_FAILED && mCqRing != mSqRing)
+		munmap(mCqRing, mCqRingSize);
+	if (mSqRing != MAP_FAILED)
+		munmap(mSqRing, mSqRingSize);
+	if (mFd != -1)
+		::close(mFd);
+	mSqes = nullptr;
+	mSqRing = mCqRing = MAP_FAILED;
+	mFd = -1;
+}
+
+void IoUring::probe() {
+	constexpr unsigned OPS = 256;
+	std::vector<uint64_t> storage((sizeof(io_uring_probe) + OPS * sizeof(io_uring_probe_op) + 7) / 8);
+	auto probe = reinterpret_cast<io_uring_probe *>(storage.data());
+	if (registerRing(mFd, IORING_REGISTER_PROBE, probe, OPS) == -1) {
+		Log::warn("io_uring: unable to probe the supported operations, errno=%d", errno);
+		return;
+	}
+	for (unsigned i = 0; i < probe->ops_len && i < OPS; i++) {
+		if ((probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0)
+			mSupported.set(probe->ops[i].op);
+	}
+}
+
+bool IoUring::enable() noexcept {
+	if (!mDisabled)
+		return isOpen();
+	if (registerRing(mFd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) == -1) {
+		Log::error("io_uring: unable to enable the ring, errno=%d", errno);
+		return false;
+	}
+	mDisabled = false;
+	return true;
+}
+
+io_uring_sqe * IoUring::getSqe() noexcept {
+	if (mSqTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) >= mSqEntries)
+		return nullptr;
+	io_uring_sqe * sqe = &mSqes[mSqTail & mSqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	mSqTail++;
+	return sqe;
+}
+
+int IoUring::submit(unsigned waitFor) noexcept {
+	const unsigned toSubmit = mSqTail - mSqSubmitted;
+	__atomic_store_n(mSqTailShared, mSqTail, __ATOMIC_RELEASE);
+	int submitted;
+	do {
+		submitted = enter(mFd, toSubmit, waitFor, (waitFor > 0) ? IORING_ENTER_GETEVENTS : 0);
+	} while (submitted == -1 && errno == EINTR && waitFor == 0);
+	if (submitted == -1)
+		return -errno;
+	mSqSubmitted += static_cast<unsigned>(submitted);
+	return submitted;
+}
+
+IoUringBufferGroup::IoUringBufferGroup(IoUring & ring, uint16_t group, unsigned count, size_t bufferSize, uint64_t userData) :
+		mRing{ring}, mGroup{group}, mBufferSize{bufferSize}, mUserData{userData},
+		mBuffers{}, mRecycled{}, mOpen{false} {
+	if (count == 0 || count > 65536) {
+		Log::error("io_uring buffer group: %u buffers is out of range", count);
+		return;
+	}
+	mBuffers = std::make_unique<char[]>(count * bufferSize);
+	mRecycled.reserve(count);
+	mOpen = ring.isOpen() && provide(0, count);
+}
+
+bool IoUringBufferGroup::commit() noexcept {
+	if (mRecycled.empty())
+		return true;
+	// Buffers are mostly consumed and recycled in order, so sorting leaves a few long runs
+	std::sort(mRecycled.begin(), mRecycled.end());
+	size_t first = 0;
+	for (size_t i = 1; i <= mRecycled.size(); i++) {
+		if (i < mRecycled.size() && mRecycled[i] == mRecycled[i - 1] + 1)
+			continue;
+		if (!provide(mRecycled[first], static_cast<unsigned>(i - first))) {
+			mRecycled.erase(mRecycled.begin(), mRecycled.begin() + static_cast<std::ptrdiff_t>(first));
+			return false;
+		}
+		first = i;
+	}
+	mRecycled.clear();
+	return true;
+}
+
+bool IoUringBufferGroup::provide(uint16_t first, unsigned count) noexcept {
+	io_uring_sqe * sqe = mRing.getSqe();
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = static_cast<int32_t>(count);
+	sqe->addr = reinterpret_cast<uint64_t>(getBuffer(first));
+	sqe->len = static_cast<uint32_t>(mBufferSize);
+	sqe->off = first;
+	sqe->buf_group = mGroup;
+	sqe->user_data = mUserData;
+	return true;
+}
+
+#else // built against uapi headers without what the rings need, see io_uring.h
+
+IoUring::IoUring(unsigned, bool, unsigned) :
+		mFd{-1}, mDisabled{false}, mSqEntries{0}, mSqTail{0}, mSqSubmitted{0}, mSqHead{nullptr}, mSqTailShared{nullptr}, mSqMask{0},
+		mSqes{nullptr}, mCqHead{nullptr}, mCqTail{nullptr}, mCqMask{0}, mCqes{nullptr}, mSqRing{nullptr},
+		mSqRingSize{0}, mCqRing{nullptr}, mCqRingSize{0}, mSqesSize{0}, mSupported{} {
+	Log::warn("io_uring is unavailable, built without the Linux 6.1 headers");
+}
+
+IoUring::~IoUring() = default;
+
+void IoUring::close() noexcept { }
+
+void IoUring::probe() { }
+
+bool IoUring::enable() noexcept {
+	return false;
+}
+
+io_uring_sqe * IoUring::getSqe() noexcept {
+	return nullptr;
+}
+
+int IoUring::submit(unsigned) noexcept {
+	return -ENOSYS;
+}
+
+IoUringBufferGroup::IoUringBufferGroup(IoUring & ring, uint16_t group, unsigned, size_t bufferSize, uint64_t userData) :
+		mRing{ring}, mGroup{group}, mBufferSize{bufferSize}, mUserData{userData}, mBuffers{}, mRecycled{}, mOpen{false} { }
+
+bool IoUringBufferGroup::commit() noexcept {
+	return false;
+}
+
+bool IoUringBufferGroup::provide(uint16_t, unsigned) noexcept {
+	return false;
+}
+
+#endif
+
+} // namespace jlcommon
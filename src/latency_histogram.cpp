@@ -0,0 +1,58 @@
+#include <latency_histogram.h>
+
+#include <cmath>
+
+namespace jlcommon {
+
+uint64_t LatencyHistogram::getValueAtQuantile(double quantile) const noexcept {
+	uint64_t total = 0;
+	for (auto & bucket : mBuckets)
+		total += bucket.load(std::memory_order_relaxed);
+	if (total == 0)
+		return 0;
+	
+	auto target = static_cast<uint64_t>(std::ceil(quantile * static_cast<double>(total)));
+	if (target == 0)
+		target = 1;
+	const uint64_t max = getMax();
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < BUCKET_COUNT; i++) {
+		seen += mBuckets[i].load(std::memory_order_relaxed);
+		if (seen >= target) {
+			const uint64_t upperBound = getBucketUpperBound(i);
+			return upperBound < max ? upperBound : max;
+		}
+	}
+	return max;
+}
+
+LatencySnapshot LatencyHistogram::snapshot() const noexcept {
+	LatencySnapshot ret;
+	ret.count = getCount();
+	ret.mean = (ret.count == 0) ? 0 : getSum() / ret.count;
+	ret.p50 = getValueAtQuantile(0.5);
+	ret.p99 = getValueAtQuantile(0.99);
+	ret.p999 = getValueAtQuantile(0.999);
+	ret.max = getMax();
+	return ret;
+}
+
+void LatencyHistogram::reset() noexcept {
+	for (auto & bucket : mBuckets)
+		bucket.store(0, std::memory_order_relaxed);
+	mCount.store(0, std::memory_order_relaxed);
+	mSum.store(0, std::memory_order_relaxed);
+	mMax.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getBucketUpperBound(unsigned int index) noexcept {
+	if (index < 2 * SUB_BUCKET_COUNT)
+		return index;
+	if (index >= BUCKET_COUNT - 1)
+		return UINT64_MAX;
+	const unsigned int shift = index / SUB_BUCKET_COUNT - 1;
+	const uint64_t subBucket = index - shift * SUB_BUCKET_COUNT;
+	return ((subBucket + 1) << shift) - 1;
+}
+
+} // namespace jlcommon
@@ -0,0 +1,123 @@
+#include <lifecycle_profile.h>
+
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+
+namespace jlcommon {
+
+namespace {
+
+constexpr const char * PHASE_NAMES[LIFECYCLE_PHASE_COUNT] = {"initialize", "start", "stop", "terminate"};
+
+struct ReportRow {
+	std::string name;
+	std::array<std::string, LIFECYCLE_PHASE_COUNT> cells;
+};
+
+void appendEscaped(std::string & out, const std::string & text) {
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+			out += escaped;
+		} else {
+			out += c;
+		}
+	}
+}
+
+void appendRows(const ServiceLifecycleProfile & profile, const ServiceLifecycleProfile & root, size_t depth, std::vector<ReportRow> & rows) {
+	ReportRow row;
+	row.name.assign(depth * 2, ' ');
+	row.name += profile.name;
+	char cell[64];
+	for (size_t phase = 0; phase < LIFECYCLE_PHASE_COUNT; phase++) {
+		const auto & timing = profile.phases[phase];
+		if (!timing.ran) {
+			row.cells[phase] = "-";
+			continue;
+		}
+		const uint64_t origin = root.phases[phase].ran ? std::min(root.phases[phase].beginNanoseconds, timing.beginNanoseconds) : timing.beginNanoseconds;
+		snprintf(cell, sizeof(cell), "%.3f%s +%.3f", timing.durationNanoseconds / 1e6, timing.succeeded ? "" : "!", (timing.beginNanoseconds - origin) / 1e6);
+		row.cells[phase] = cell;
+	}
+	rows.emplace_back(std::move(row));
+	for (const auto & child : profile.children)
+		appendRows(child, root, depth + 1, rows);
+}
+
+void appendJson(const ServiceLifecycleProfile & profile, std::string & json) {
+	json += "{\"name\":\"";
+	appendEscaped(json, profile.name);
+	json += "\",\"phases\":{";
+	bool first = true;
+	char numbers[128];
+	for (size_t phase = 0; phase < LIFECYCLE_PHASE_COUNT; phase++) {
+		const auto & timing = profile.phases[phase];
+		if (!timing.ran)
+			continue;
+		snprintf(numbers, sizeof(numbers), "%s\"%s\":{\"begin\":%llu,\"duration\":%llu,\"succeeded\":%s}", first ? "" : ",", PHASE_NAMES[phase],
+				static_cast<unsigned long long>(timing.beginNanoseconds), static_cast<unsigned long long>(timing.durationNanoseconds), timing.succeeded ? "true" : "false");
+		json += numbers;
+		first = false;
+	}
+	json += "},\"children\":[";
+	for (size_t i = 0; i < profile.children.size(); i++) {
+		if (i > 0)
+			json += ',';
+		appendJson(profile.children[i], json);
+	}
+	json += "]}";
+}
+
+} // namespace
+
+const char * getLifecyclePhaseName(LifecyclePhase phase) noexcept {
+	return PHASE_NAMES[static_cast<size_t>(phase)];
+}
+
+std::string ServiceLifecycleProfile::getReport() const {
+	std::vector<ReportRow> rows;
+	rows.push_back(ReportRow{"service", {"initialize ms", "start ms", "stop ms", "terminate ms"}});
+	appendRows(*this, *this, 0, rows);
+	
+	size_t nameWidth = 0;
+	std::array<size_t, LIFECYCLE_PHASE_COUNT> cellWidths{};
+	for (const auto & row : rows) {
+		nameWidth = std::max(nameWidth, row.name.size());
+		for (size_t phase = 0; phase < LIFECYCLE_PHASE_COUNT; phase++)
+			cellWidths[phase] = std::max(cellWidths[phase], row.cells[phase].size());
+	}
+	
+	std::string report;
+	for (const auto & row : rows) {
+		report += row.name;
+		report.append(nameWidth - row.name.size(), ' ');
+		for (size_t phase = 0; phase < LIFECYCLE_PHASE_COUNT; phase++) {
+			report.append(2 + cellWidths[phase] - row.cells[phase].size(), ' ');
+			report += row.cells[phase];
+		}
+		report += '\n';
+	}
+	return report;
+}
+
+std::string ServiceLifecycleProfile::getJson() const {
+	std::string json;
+	appendJson(*this, json);
+	return json;
+}
+
+bool ServiceLifecycleProfile::dumpJson(const std::string & path) const {
+	std::ofstream out(path, std::ios::out | std::ios::trunc);
+	if (!out)
+		return false;
+	out << getJson();
+	return static_cast<bool>(out);
+}
+
+} // namespace jlcommon
@@ -0,0 +1,219 @@
+#include <shared_memory_bus.h>
+#include <log.h>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <climits>
+#include <ctime>
+
+namespace jlcommon {
+
+namespace {
+
+constexpr uint64_t RING_MAGIC = 0x4A4C434D53484D31ull; // "JLCMSHM1"
+
+enum RingState : uint32_t {
+	RING_UNINITIALIZED = 0, // freshly truncated memory is zeroed
+	RING_INITIALIZING  = 1,
+	RING_READY         = 2
+};
+
+static_assert(std::atomic_uint32_t::is_always_lock_free && std::atomic_uint64_t::is_always_lock_free,
+		"the ring is shared between processes, so its atomics must not rely on process-local locks");
+
+inline long futex(std::atomic_uint32_t & word, int op, uint32_t value, const struct timespec * timeout) noexcept {
+	// Not FUTEX_PRIVATE_FLAG: the word is shared with other processes
+	return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), op, value, timeout, nullptr, 0);
+}
+
+} // namespace
+
+struct SharedMemoryRing::Header {
+	uint64_t magic;
+	std::atomic_uint32_t state;
+	uint32_t slotCount;
+	uint32_t slotSize;
+	alignas(64) std::atomic_uint64_t writeSequence;
+	alignas(64) std::atomic_uint32_t futexWord;
+	std::atomic_uint32_t sleepers;
+};
+
+/**
+ * The stamp is 0 while never written, 2*sequence+1 while the message with that sequence is being written and
+ * 2*sequence+2 once it is complete. Readers copy the slot and check the stamp again, like a seqlock, and the payload is
+ * made of relaxed atomic words so that a concurrent overwrite is detected rather than undefined.
+ */
+struct SharedMemoryRing::Slot {
+	std::atomic_uint64_t stamp;
+	std::atomic_uint64_t origin;
+	std::atomic_uint64_t typeAndSize;
+	std::atomic_uint64_t payload[1]; // actually slotSize / 8 words
+};
+
+SharedMemoryRing::SharedMemoryRing(const std::string & name, uint32_t slotCount, uint32_t slotSize) :
+		mHeader(nullptr),
+		mMappingSize(0),
+		mSlotCount(slotCount),
+		mSlotSize((slotSize + 7) & ~7u),
+		mSlotStride((offsetof(Slot, payload) + mSlotSize + 63) & ~static_cast<size_t>(63)),
+		mReadBuffer(new uint64_t[mSlotSize / 8 + 1]) {
+	if (slotCount == 0 || (slotCount & (slotCount - 1)) != 0) {
+		Log::error("Shared memory ring %s: slot count %u is not a power of two", name.c_str(), slotCount);
+		return;
+	}
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		Log::error("Shared memory ring %s: shm_open failed, errno=%d", name.c_str(), errno);
+		return;
+	}
+	const size_t size = sizeof(Header) + mSlotStride * slotCount;
+	struct stat st{};
+	if (fstat(fd, &st) == -1 || (static_cast<size_t>(st.st_size) < size && ftruncate(fd, static_cast<off_t>(size)) == -1)) {
+		Log::error("Shared memory ring %s: unable to size the segment, errno=%d", name.c_str(), errno);
+		close(fd);
+		return;
+	}
+	void * mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		Log::error("Shared memory ring %s: mmap failed, errno=%d", name.c_str(), errno);
+		return;
+	}
+	
+	auto header = static_cast<Header *>(mapping);
+	uint32_t state = RING_UNINITIALIZED;
+	if (header->state.compare_exchange_strong(state, RING_INITIALIZING)) {
+		header->magic = RING_MAGIC;
+		header->slotCount = slotCount;
+		header->slotSize = mSlotSize;
+		header->state.store(RING_READY, std::memory_order_release);
+	} else {
+		for (int i = 0; i < 1000 && header->state.load(std::memory_order_acquire) != RING_READY; i++)
+			usleep(100);
+	}
+	if (header->state.load(std::memory_order_acquire) != RING_READY || header->magic != RING_MAGIC || header->slotCount != slotCount || header->slotSize != mSlotSize) {
+		Log::error("Shared memory ring %s was created with a different layout", name.c_str());
+		munmap(mapping, size);
+		return;
+	}
+	mHeader = header;
+	mMappingSize = size;
+}
+
+SharedMemoryRing::~SharedMemoryRing() {
+	if (mHeader != nullptr)
+		munmap(mHeader, mMappingSize);
+}
+
+bool SharedMemoryRing::write(uint64_t origin, uint32_t type, const void * data, uint32_t size) noexcept {
+	if (mHeader == nullptr || size > mSlotSize)
+		return false;
+	const uint64_t sequence = mHeader->writeSequence.fetch_add(1, std::memory_order_relaxed);
+	Slot & slot = getSlot(sequence);
+	slot.stamp.store(2 * sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	
+	slot.origin.store(origin, std::memory_order_relaxed);
+	slot.typeAndSize.store((static_cast<uint64_t>(type) << 32) | size, std::memory_order_relaxed);
+	auto bytes = static_cast<const unsigned char *>(data);
+	for (uint32_t offset = 0; offset < size; offset += 8) {
+		uint64_t word = 0;
+		std::memcpy(&word, bytes + offset, (size - offset < 8) ? size - offset : 8);
+		slot.payload[offset / 8].store(word, std::memory_order_relaxed);
+	}
+	slot.stamp.store(2 * sequence + 2, std::memory_order_release);
+	
+	// Pairs with the fence in wait(): either the sleeper is seen here, or it sees this message before sleeping
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (mHeader->sleepers.load(std::memory_order_relaxed) != 0) {
+		mHeader->futexWord.fetch_add(1, std::memory_order_release);
+		futex(mHeader->futexWord, FUTEX_WAKE, INT_MAX, nullptr);
+	}
+	return true;
+}
+
+uint64_t SharedMemoryRing::getWriteSequence() const noexcept {
+	return (mHeader == nullptr) ? 0 : mHeader->writeSequence.load(std::memory_order_acquire);
+}
+
+bool SharedMemoryRing::read(uint64_t & cursor, Message & message, uint64_t & dropped) noexcept {
+	if (mHeader == nullptr)
+		return false;
+	while (true) {
+		Slot & slot = getSlot(cursor);
+		const uint64_t expected = 2 * cursor + 2;
+		const uint64_t stamp = slot.stamp.load(std::memory_order_acquire);
+		if (stamp == expected) {
+			message.origin = slot.origin.load(std::memory_order_relaxed);
+			const uint64_t typeAndSize = slot.typeAndSize.load(std::memory_order_relaxed);
+			message.type = static_cast<uint32_t>(typeAndSize >> 32);
+			message.size = static_cast<uint32_t>(typeAndSize);
+			if (message.size <= mSlotSize) {
+				for (uint32_t word = 0; word * 8 < message.size; word++)
+					mReadBuffer[word] = slot.payload[word].load(std::memory_order_relaxed);
+				message.data = mReadBuffer.get();
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.stamp.load(std::memory_order_relaxed) == expected) {
+					cursor++;
+					return true;
+				}
+			}
+		} else if (stamp < expected && mHeader->writeSequence.load(std::memory_order_acquire) <= cursor + mSlotCount) {
+			return false; // not written yet, or still being written
+		}
+		// Overwritten by a writer a full ring ahead, or abandoned by a writer that died: skip to the oldest live slot
+		const uint64_t written = mHeader->writeSequence.load(std::memory_order_acquire);
+		const uint64_t oldest = (written > mSlotCount) ? written - mSlotCount + 1 : 0;
+		const uint64_t next = (oldest > cursor) ? oldest : cursor + 1;
+		dropped += next - cursor;
+		cursor = next;
+	}
+}
+
+void SharedMemoryRing::wait(uint64_t cursor, uint32_t timeoutMicroseconds) noexcept {
+	if (mHeader == nullptr)
+		return;
+	mHeader->sleepers.fetch_add(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	const uint32_t word = mHeader->futexWord.load(std::memory_order_acquire);
+	if (!isReadable(cursor)) {
+		struct timespec timeout{};
+		timeout.tv_sec = timeoutMicroseconds / 1000000;
+		timeout.tv_nsec = static_cast<long>(timeoutMicroseconds % 1000000) * 1000;
+		futex(mHeader->futexWord, FUTEX_WAIT, word, &timeout);
+	}
+	mHeader->sleepers.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void SharedMemoryRing::wakeAll() noexcept {
+	if (mHeader == nullptr)
+		return;
+	mHeader->futexWord.fetch_add(1, std::memory_order_seq_cst);
+	futex(mHeader->futexWord, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+bool SharedMemoryRing::unlink(const std::string & name) noexcept {
+	return shm_unlink(name.c_str()) == 0;
+}
+
+SharedMemoryRing::Slot & SharedMemoryRing::getSlot(uint64_t sequence) const noexcept {
+	auto slots = reinterpret_cast<unsigned char *>(mHeader) + sizeof(Header);
+	return *reinterpret_cast<Slot *>(slots + (sequence & (mSlotCount - 1)) * mSlotStride);
+}
+
+bool SharedMemoryRing::isReadable(uint64_t cursor) const noexcept {
+	return getSlot(cursor).stamp.load(std::memory_order_acquire) >= 2 * cursor + 2 || mHeader->writeSequence.load(std::memory_order_acquire) > cursor + mSlotCount;
+}
+
+uint64_t SharedMemoryIntentBus::createOrigin() noexcept {
+	static std::atomic_uint32_t instances{0};
+	return (static_cast<uint64_t>(getpid()) << 32) | instances.fetch_add(1);
+}
+
+} // namespace jlcommon
@@ -0,0 +1,195 @@
+#include <trace.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+
+namespace jlcommon {
+
+namespace Trace {
+
+namespace Internal {
+std::atomic_bool enabled{false};
+} // namespace Internal
+
+namespace {
+
+struct Event {
+	uint64_t begin;
+	uint64_t end;
+	const char * category;
+	char name[96];
+};
+
+/**
+ * Ring of the most recent events of one thread. Only the owning thread writes, publishing each event through head.
+ */
+struct ThreadBuffer {
+	ThreadBuffer(uint32_t tid, size_t capacity) : tid(tid), events(capacity) { }
+	
+	const uint32_t tid;
+	std::vector<Event> events;
+	std::atomic_uint64_t head{0};
+};
+
+std::mutex registryLock;
+std::vector<std::shared_ptr<ThreadBuffer>> registry;
+std::deque<std::shared_ptr<ThreadBuffer>> retired; // the last events of exited threads, oldest first
+size_t retiredEvents = 0;
+uint32_t nextTid = 1;
+std::atomic_size_t eventsPerThread{65536};
+
+/**
+ * Moves the events of a buffer its thread no longer writes to the retired list, keeping at most eventsPerThread of
+ * them in total. Requires registryLock.
+ */
+void retire(const std::shared_ptr<ThreadBuffer> & buffer) {
+	registry.erase(std::remove(registry.begin(), registry.end(), buffer), registry.end());
+	const uint64_t head = buffer->head.load(std::memory_order_acquire);
+	const uint64_t capacity = buffer->events.size();
+	const uint64_t count = head < capacity ? head : capacity;
+	if (count == 0)
+		return;
+	auto copy = std::make_shared<ThreadBuffer>(buffer->tid, count);
+	for (uint64_t i = 0; i < count; i++)
+		copy->events[i] = buffer->events[(head - count + i) % capacity];
+	copy->head.store(count, std::memory_order_relaxed);
+	retired.emplace_back(std::move(copy));
+	retiredEvents += count;
+	while (retiredEvents > eventsPerThread.load(std::memory_order_relaxed)) {
+		retiredEvents -= retired.front()->events.size();
+		retired.pop_front();
+	}
+}
+
+/**
+ * Owns the buffer of a thread, handing its events over to the retired list when the thread exits
+ */
+struct LocalBuffer {
+	std::shared_ptr<ThreadBuffer> buffer;
+	
+	~LocalBuffer() {
+		if (!buffer)
+			return;
+		try {
+			std::lock_guard<std::mutex> lk(registryLock);
+			retire(buffer);
+		} catch (...) {
+			// The events are lost, but the buffer is still released
+		}
+	}
+};
+
+thread_local LocalBuffer localBuffer;
+
+ThreadBuffer & getLocalBuffer() {
+	auto & buffer = localBuffer.buffer;
+	const size_t capacity = eventsPerThread.load(std::memory_order_relaxed);
+	if (!buffer || buffer->events.size() != capacity) { // first event of the thread, or enable() changed the size
+		std::lock_guard<std::mutex> lk(registryLock);
+		auto created = std::make_shared<ThreadBuffer>(buffer ? buffer->tid : nextTid++, capacity);
+		if (buffer)
+			retire(buffer);
+		registry.emplace_back(created);
+		buffer = std::move(created);
+	}
+	return *buffer;
+}
+
+void appendEscaped(std::string & out, const char * str) {
+	for (; *str != '\0'; str++) {
+		switch (*str) {
+			case '"':  out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			default:
+				if (static_cast<unsigned char>(*str) >= 0x20)
+					out += *str;
+				break;
+		}
+	}
+}
+
+} // namespace
+
+void enable(size_t capacity) {
+	eventsPerThread = (capacity == 0) ? 1 : capacity;
+	Internal::enabled = true;
+}
+
+void disable() {
+	Internal::enabled = false;
+}
+
+void clear() {
+	std::lock_guard<std::mutex> lk(registryLock);
+	for (auto & buffer : registry)
+		buffer->head.store(0, std::memory_order_release);
+	retired.clear();
+	retiredEvents = 0;
+}
+
+void record(const char * category, const char * name, const char * detail, uint64_t beginNanoseconds, uint64_t endNanoseconds) noexcept {
+	try {
+		auto & buffer = getLocalBuffer();
+		const uint64_t head = buffer.head.load(std::memory_order_relaxed);
+		auto & event = buffer.events[head % buffer.events.size()];
+		event.begin = beginNanoseconds;
+		event.end = endNanoseconds;
+		event.category = category;
+		if (detail == nullptr)
+			snprintf(event.name, sizeof(event.name), "%s", name);
+		else
+			snprintf(event.name, sizeof(event.name), "%s %s", name, detail);
+		buffer.head.store(head + 1, std::memory_order_release);
+	} catch (...) {
+		// Tracing must never disturb the traced code, so a failed registration drops the event
+	}
+}
+
+std::string getChromeTraceJson() {
+	std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+	{
+		std::lock_guard<std::mutex> lk(registryLock);
+		buffers.assign(retired.begin(), retired.end());
+		buffers.insert(buffers.end(), registry.begin(), registry.end());
+	}
+	
+	std::string json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	bool first = true;
+	char numbers[128];
+	for (auto & buffer : buffers) {
+		const uint64_t head = buffer->head.load(std::memory_order_acquire);
+		const uint64_t capacity = buffer->events.size();
+		const uint64_t count = head < capacity ? head : capacity;
+		for (uint64_t i = head - count; i < head; i++) {
+			const auto & event = buffer->events[i % capacity];
+			json += first ? "{\"name\":\"" : ",{\"name\":\"";
+			first = false;
+			appendEscaped(json, event.name);
+			json += "\",\"cat\":\"";
+			appendEscaped(json, event.category);
+			snprintf(numbers, sizeof(numbers), "\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+					event.begin / 1000.0, (event.end - event.begin) / 1000.0, buffer->tid);
+			json += numbers;
+		}
+	}
+	json += "]}";
+	return json;
+}
+
+bool dumpChromeTrace(const std::string & path) {
+	std::ofstream out(path, std::ios::out | std::ios::trunc);
+	if (!out)
+		return false;
+	out << getChromeTraceJson();
+	return static_cast<bool>(out);
+}
+
+} // namespace Trace
+
+} // namespace jlcommon
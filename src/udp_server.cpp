@@ -1,34 +1,250 @@
 #include <udp_server.h>
 
+#include <event_loop.h>
+#include <io_uring.h>
+#include <log.h>
+#include <thread_pool.h>
+
+#include <linux/filter.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <unistd.h>
+#include <limits.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 
 namespace jlcommon {
 
+namespace {
+
+constexpr uint64_t RING_RECEIVE = 1;
+constexpr uint64_t RING_WAKE_UP = 2;
+constexpr uint64_t RING_BUFFERS = 3;
+constexpr uint64_t RING_CANCEL = 4;
+
+} // namespace
+
+struct UdpServer::Shard {
+	int fd{-1};
+	int cpu{-1};
+	std::unique_ptr<std::thread> thread;
+	uint64_t loopSource{0};                          // instead of the thread, with an event loop
+	std::unique_ptr<char[]> buffer;
+	std::vector<struct mmsghdr> messages;
+	std::vector<struct iovec> vectors;
+	std::vector<struct sockaddr_storage> addresses;
+	std::vector<UdpDatagram> datagrams;
+	std::unique_ptr<IntentPool<UdpPacket>> pool;
+	std::vector<std::shared_ptr<UdpPacket>> packets; // received into in packet mode, refilled once handed out
+	std::unique_ptr<IoUringBufferGroup> buffers;     // outlives the ring that may still write to it
+	std::unique_ptr<IoUring> ring;
+	struct msghdr receiveHeader{};                   // the layout of every multishot completion
+	std::vector<uint16_t> bufferIds;                 // behind the datagrams not yet delivered
+	int wakeFd{-1};                                  // written by stop(), since the reader sleeps in the ring
+	uint64_t wakeValue{0};
+};
+
+UdpServer::UdpServer(const InetAddress& bindAddress, const UdpServerConfig & config) :
+		mBindAddress   {new InetAddress(bindAddress)},
+		mHandlers      {std::make_shared<Handlers>(Handlers{[](auto buf, auto len){ (void)buf; (void)len; }, {}, {}})},
+		mHandlerLock   {},
+		mSockfd        {-1},
+		mRunning       {false},
+		mConfig        {config},
+		mShards        {},
+		mSegmentationSupported{true} {
+	start();
+}
+
 UdpServer::~UdpServer() {
 	stop();
 	delete mBindAddress;
-	delete [] mReadBuffer;
 }
 
 int UdpServer::send(InetAddress & addr, const void * buffer, size_t len, int flags) {
 	return sendto(mSockfd, buffer, len, flags, addr.getAddress(), addr.getAddressLength());
 }
 
+size_t UdpServer::send(UdpSendBatch & batch, int flags) {
+	batch.prepare();
+	if (mConfig.useIoUring) {
+		std::lock_guard<std::mutex> guard(mSendLock);
+		if (mSendRing)
+			return sendThroughRing(batch, flags);
+	}
+	const size_t count = batch.mEntries.size();
+	size_t sent = 0;
+	size_t i = 0;
+	while (i < count) {
+		const bool segmentation = mSegmentationSupported.load(std::memory_order_relaxed);
+		if (batch.mEntries[i].segmentSize != 0 && !segmentation) {
+			batch.mResults[i] = sendSegments(batch.mEntries[i], flags);
+			sent += (batch.mResults[i] >= 0) ? 1 : 0;
+			i++;
+			continue;
+		}
+		size_t end = i + 1;
+		while (end < count && end - i < IOV_MAX && (segmentation || batch.mEntries[end].segmentSize == 0))
+			end++;
+		const int n = sendmmsg(mSockfd, &batch.mMessages[i], static_cast<unsigned int>(end - i), flags);
+		if (n > 0) {
+			for (size_t j = i; j < i + static_cast<size_t>(n); j++)
+				batch.mResults[j] = batch.mMessages[j].msg_len;
+			sent += static_cast<size_t>(n);
+			i += static_cast<size_t>(n);
+			continue;
+		}
+		// sendmmsg reports the error of the first message only when nothing was sent, so it is always entry i
+		const int error = errno;
+		if (error == EINTR)
+			continue;
+		if (batch.mEntries[i].segmentSize != 0 && (error == EIO || error == ENOPROTOOPT || error == EOPNOTSUPP)) {
+			mSegmentationSupported = false; // no checksum offload, or a kernel without UDP_SEGMENT
+			continue;
+		}
+		batch.mResults[i] = -error;
+		i++;
+	}
+	return sent;
+}
+
+bool UdpServer::isUsingIoUring() const {
+	std::lock_guard<std::mutex> guard(mSendLock);
+	return static_cast<bool>(mSendRing);
+}
+
+ssize_t UdpServer::sendSegments(const UdpSendBatch::Entry & entry, int flags) {
+	auto data = static_cast<const char *>(entry.data);
+	size_t offset = 0;
+	while (offset < entry.length) {
+		const size_t length = std::min<size_t>(entry.segmentSize, entry.length - offset);
+		if (sendto(mSockfd, data + offset, length, flags, (const struct sockaddr *) &entry.address, entry.addressLength) == -1)
+			return -errno;
+		offset += length;
+	}
+	return static_cast<ssize_t>(entry.length);
+}
+
+void UdpSendBatch::addEntry(InetAddress & addr, const void * buffer, size_t len, uint16_t segmentSize) {
+	Entry entry{};
+	entry.data = buffer;
+	entry.length = len;
+	entry.segmentSize = segmentSize;
+	entry.addressLength = static_cast<socklen_t>(std::min(addr.getAddressLength(), sizeof(entry.address)));
+	memcpy(&entry.address, addr.getAddress(), entry.addressLength);
+	mEntries.emplace_back(entry);
+}
+
+void UdpSendBatch::prepare() {
+	const size_t count = mEntries.size();
+	const size_t controlSize = CMSG_SPACE(sizeof(uint16_t));
+	mMessages.resize(count);
+	mVectors.resize(count);
+	mControl.assign(count * controlSize, 0);
+	mResults.assign(count, 0);
+	for (size_t i = 0; i < count; i++) {
+		Entry & entry = mEntries[i];
+		mVectors[i].iov_base = const_cast<void *>(entry.data);
+		mVectors[i].iov_len = entry.length;
+		mMessages[i] = {};
+		mMessages[i].msg_hdr.msg_name = &entry.address;
+		mMessages[i].msg_hdr.msg_namelen = entry.addressLength;
+		mMessages[i].msg_hdr.msg_iov = &mVectors[i];
+		mMessages[i].msg_hdr.msg_iovlen = 1;
+		if (entry.segmentSize == 0)
+			continue;
+		auto & header = mMessages[i].msg_hdr;
+		header.msg_control = mControl.data() + i * controlSize;
+		header.msg_controllen = controlSize;
+		struct cmsghdr * control = CMSG_FIRSTHDR(&header);
+		control->cmsg_level = SOL_UDP;
+		control->cmsg_type = UDP_SEGMENT;
+		control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		memcpy(CMSG_DATA(control), &entry.segmentSize, sizeof(uint16_t));
+	}
+}
+
 void UdpServer::setBroadcast(int enabled) {
 	setsockopt(mSockfd, SOL_SOCKET, SO_BROADCAST, &enabled, sizeof(enabled));
 }
 
 void UdpServer::start() {
+	const size_t shards = (mConfig.shards == 0) ? 1 : mConfig.shards;
+	const size_t batch = (mConfig.receiveBatch == 0) ? 1 : mConfig.receiveBatch;
+	for (size_t i = 0; i < shards; i++) {
+		// Every shard after the first binds to the port the first one got, in case it was ephemeral
+		const int fd = openSocket(shards > 1);
+		if (fd == -1) {
+			for (auto & shard : mShards)
+				close(shard->fd);
+			mShards.clear();
+			return;
+		}
+		auto shard = std::make_unique<Shard>();
+		shard->fd = fd;
+		shard->cpu = mConfig.shardCpus.empty() ? -1 : mConfig.shardCpus[i % mConfig.shardCpus.size()];
+		shard->buffer = std::make_unique<char[]>(batch * mConfig.maxDatagramSize);
+		shard->messages.resize(batch);
+		shard->vectors.resize(batch);
+		shard->addresses.resize(batch);
+		shard->datagrams.resize(batch);
+		shard->pool = std::make_unique<IntentPool<UdpPacket>>(mConfig.maxIdlePackets);
+		shard->packets.resize(batch);
+		mShards.emplace_back(std::move(shard));
+	}
+	if (shards > 1 && mConfig.steerByPeerAddress && !attachSteeringProgram())
+		perror("listener: SO_ATTACH_REUSEPORT_CBPF");
+	if (mConfig.useIoUring && !openRings()) {
+		Log::warn("UdpServer: io_uring is unavailable, using poll and recvmmsg");
+		for (auto & shard : mShards) {
+			shard->buffers.reset();
+			shard->ring.reset();
+			if (shard->wakeFd != -1)
+				close(shard->wakeFd);
+			shard->wakeFd = -1;
+		}
+		mSendRing.reset();
+	}
+	
+	mSockfd = mShards.front()->fd;
+	mRunning = true;
+	for (auto & shard : mShards) {
+		Shard * s = shard.get();
+		if (!mConfig.eventLoop) {
+			s->thread = std::make_unique<std::thread>([this, s]{read(*s);});
+			continue;
+		}
+		// recvmmsg with MSG_DONTWAIT drains the socket, as edge-triggered events need
+		s->loopSource = mConfig.eventLoop->add(s->fd, EPOLLIN, [this, s](uint32_t) {
+			if (mRunning)
+				receiveAvailable(*s);
+		});
+		if (s->loopSource == 0)
+			Log::error("UdpServer: unable to attach socket %d to the event loop", s->fd);
+	}
+}
+
+int UdpServer::openSocket(bool reusePort) {
 	int fd;
 	if ((fd = socket(mBindAddress->getAddress()->sa_family, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
 		perror("listener: socket");
-		return;
+		return -1;
+	}
+	
+	const int enabled = 1;
+	if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) == -1) {
+		close(fd);
+		perror("listener: SO_REUSEPORT");
+		return -1;
 	}
 	
 	if (bind(fd, mBindAddress->getAddress(), mBindAddress->getAddressLength()) == -1) {
 		close(fd);
 		perror("listener: bind");
-		return;
+		return -1;
 	}
 	
 	{
@@ -37,48 +253,405 @@ void UdpServer::start() {
 		if (getsockname(fd, (struct sockaddr *)&addr, &addrLen) == -1) {
 			close(fd);
 			perror("getsockname");
-			return;
+			return -1;
 		} else {
 			delete mBindAddress;
 			mBindAddress = new InetAddress((struct sockaddr *) &addr, addrLen);
 		}
 	}
-	
-	mSockfd = fd;
-	mReadThread = std::make_unique<std::thread>([this]{read();});
+	return fd;
+}
+
+bool UdpServer::attachSteeringProgram() {
+	// Sockets join the reuseport group in bind order, so the index the program returns is the shard index. The source
+	// address is read relative to the network header, since the program sees the packet from the UDP payload on.
+	const auto shards = static_cast<uint32_t>(mShards.size());
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF)),       // A = first byte of the IP header
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K,   4),                                       // A = IP version
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   4, 0, 2),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 12)),  // IPv4 source address
+		BPF_JUMP(BPF_JMP | BPF_JA,            10, 0, 0),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 8)),   // IPv6 source address, folded
+		BPF_STMT(BPF_MISC | BPF_TAX,          0),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 12)),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+		BPF_STMT(BPF_MISC | BPF_TAX,          0),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 16)),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+		BPF_STMT(BPF_MISC | BPF_TAX,          0),
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, static_cast<uint32_t>(SKF_NET_OFF + 20)),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K,   0x9E3779B1u),                             // mix, then pick a shard
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K,   16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,   shards),
+		BPF_STMT(BPF_RET | BPF_A,             0),
+	};
+	struct sock_fprog program{};
+	program.len = sizeof(code) / sizeof(code[0]);
+	program.filter = code;
+	return setsockopt(mShards.front()->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
 }
 
 void UdpServer::stop() {
 	if (mSockfd != -1) {
-		shutdown(mSockfd, SHUT_RDWR);
-		mReadThread->join();
+		mRunning = false;
+		for (auto & shard : mShards) {
+			if (shard->wakeFd != -1)
+				eventfd_write(shard->wakeFd, 1);
+			shutdown(shard->fd, SHUT_RDWR);
+		}
+		for (auto & shard : mShards) {
+			if (shard->thread)
+				shard->thread->join();
+			else if (shard->loopSource != 0)
+				mConfig.eventLoop->remove(shard->loopSource);
+			close(shard->fd);
+			if (shard->wakeFd != -1)
+				close(shard->wakeFd);
+		}
+		mShards.clear();
 		mSockfd = -1;
 	}
 }
 
-void UdpServer::read() {
-	fd_set readfds;
-	fd_set excpfds;
-	
-	FD_ZERO(&readfds);
-	FD_ZERO(&excpfds);
-	FD_SET(mSockfd, &readfds);
-	FD_SET(mSockfd, &excpfds);
+void UdpServer::read(Shard & shard) {
+	if (shard.cpu >= 0)
+		pinCurrentThread(shard.cpu, "UDP reader");
+	if (shard.ring && shard.ring->enable()) {
+		readRing(shard);
+		if (!mRunning)
+			return;
+		Log::warn("UdpServer: io_uring receive stopped, using poll and recvmmsg");
+		cancelReceive(shard);
+	}
 	
-	struct sockaddr_storage remoteAddr;
-	socklen_t remoteAddrLen = sizeof(remoteAddr);
-	ssize_t n;
+	struct pollfd pfd{};
+	pfd.fd = shard.fd;
+	pfd.events = POLLIN;
 	
-	while (mSockfd != -1 && select(mSockfd+1, &readfds, NULL, &excpfds, NULL) != -1) {
-		if (FD_ISSET(mSockfd, &readfds)) {
-			if ((n = recvfrom(mSockfd, mReadBuffer, mReadBufferSize, MSG_DONTWAIT, (struct sockaddr *) &remoteAddr, &remoteAddrLen)) == -1) {
+	while (mRunning) {
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (!mRunning || (pfd.revents & (POLLERR | POLLNVAL)) != 0 || !receiveAvailable(shard))
+			break;
+	}
+}
+
+#if JLCOMMON_IO_URING
+
+bool UdpServer::openRings() {
+	const size_t bufferSize = sizeof(io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + mConfig.maxDatagramSize;
+	if (!mConfig.eventLoop) { // otherwise the loop receives, and only sends go through a ring
+		for (auto & shard : mShards) {
+			// Every buffer may be waiting in the completion queue at once, along with the entries that handed them back
+			shard->ring = std::make_unique<IoUring>(32, true, 2 * mConfig.ioUringBuffers);
+			if (!shard->ring->isOpen())
+				return false;
+			// Buffer selection came with PROVIDE_BUFFERS, and multishot receives in the release that added SEND_ZC
+			for (uint8_t opcode : {IORING_OP_RECVMSG, IORING_OP_PROVIDE_BUFFERS, IORING_OP_SEND_ZC, IORING_OP_READ, IORING_OP_ASYNC_CANCEL}) {
+				if (!shard->ring->isSupported(opcode))
+					return false;
+			}
+			shard->buffers = std::make_unique<IoUringBufferGroup>(*shard->ring, 0, mConfig.ioUringBuffers, bufferSize, RING_BUFFERS);
+			if (!shard->buffers->isOpen())
+				return false;
+			shard->wakeFd = eventfd(0, EFD_CLOEXEC);
+			if (shard->wakeFd == -1)
+				return false;
+			shard->receiveHeader.msg_namelen = sizeof(struct sockaddr_storage);
+			shard->bufferIds.resize(shard->datagrams.size());
+		}
+	}
+	mSendRing = std::make_unique<IoUring>(64);
+	return mSendRing->isOpen() && mSendRing->isSupported(IORING_OP_SENDMSG);
+}
+
+size_t UdpServer::sendThroughRing(UdpSendBatch & batch, int flags) {
+	IoUring & ring = *mSendRing;
+	const size_t count = batch.mEntries.size();
+	size_t i = 0;
+	while (i < count) {
+		// Queue as many entries as the ring holds, then submit them and wait for all of them in a single system call
+		unsigned queued = 0;
+		for (; i < count; i++) {
+			if (batch.mEntries[i].segmentSize != 0 && !mSegmentationSupported.load(std::memory_order_relaxed)) {
+				batch.mResults[i] = sendSegments(batch.mEntries[i], flags);
+				continue;
+			}
+			io_uring_sqe * sqe = ring.getSqe();
+			if (sqe == nullptr)
+				break;
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = mSockfd;
+			sqe->addr = reinterpret_cast<uint64_t>(&batch.mMessages[i].msg_hdr);
+			sqe->len = 1;
+			sqe->msg_flags = static_cast<uint32_t>(flags);
+			sqe->user_data = i;
+			batch.mResults[i] = -EINPROGRESS;
+			queued++;
+		}
+		unsigned completed = 0;
+		while (completed < queued) {
+			const int result = ring.submit(queued - completed);
+			if (result < 0 && result != -EINTR && result != -EAGAIN && result != -EBUSY) {
+				// The ring is unusable: closing it drops whatever it still holds, and later batches use sendmmsg
+				Log::error("UdpServer: io_uring send failed, errno=%d", -result);
+				mSendRing.reset();
+				for (size_t j = 0; j < count; j++) {
+					if (j >= i || batch.mResults[j] == -EINPROGRESS)
+						batch.mResults[j] = result;
+				}
+				i = count;
 				break;
 			}
-			mReadHandler(const_cast<const char *>(mReadBuffer), n);
-		} else if (FD_ISSET(mSockfd, &excpfds)) {
+			completed += ring.reap([&](const io_uring_cqe & cqe) {
+				batch.mResults[cqe.user_data] = cqe.res;
+			});
+		}
+		if (!mSendRing)
+			break;
+	}
+	
+	size_t sent = 0;
+	for (i = 0; i < count; i++) {
+		ssize_t & result = batch.mResults[i];
+		if (batch.mEntries[i].segmentSize != 0 && (result == -EIO || result == -ENOPROTOOPT || result == -EOPNOTSUPP)) {
+			mSegmentationSupported = false; // no checksum offload, or a kernel without UDP_SEGMENT
+			result = sendSegments(batch.mEntries[i], flags);
+		}
+		sent += (result >= 0) ? 1 : 0;
+	}
+	return sent;
+}
+
+void UdpServer::readRing(Shard & shard) {
+	IoUring & ring = *shard.ring;
+	IoUringBufferGroup & buffers = *shard.buffers;
+	const size_t batch = shard.datagrams.size();
+	// Each buffer starts with an io_uring_recvmsg_out, followed by room for the address, then the payload
+	const size_t headerSize = sizeof(io_uring_recvmsg_out) + shard.receiveHeader.msg_namelen;
+	const size_t capacity = buffers.getBufferSize() - headerSize;
+	size_t pending = 0;
+	auto flush = [&]() {
+		deliver(shard, pending, *std::atomic_load_explicit(&mHandlers, std::memory_order_acquire));
+		for (size_t i = 0; i < pending; i++)
+			buffers.recycle(shard.bufferIds[i]);
+		pending = 0;
+		while (!buffers.commit())
+			ring.submit();
+	};
+	
+	bool receiving = false;
+	bool waking = false;
+	while (mRunning) {
+		if ((!receiving && !(receiving = postReceive(shard))) || (!waking && !(waking = postWakeUp(shard))))
+			break;
+		const int result = ring.submit(1);
+		if (result < 0 && result != -EINTR && result != -EBUSY) {
+			Log::error("UdpServer: io_uring wait failed, errno=%d", -result);
+			break;
+		}
+		int error = 0;
+		ring.reap([&](const io_uring_cqe & cqe) {
+			if (cqe.user_data == RING_WAKE_UP) {
+				waking = false;
+				return;
+			}
+			if (cqe.user_data != RING_RECEIVE)
+				return;
+			if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+				receiving = false; // posted again after this round, e.g. once buffers are back from ENOBUFS
+			if (cqe.res < 0 && cqe.res != -ENOBUFS)
+				error = -cqe.res;
+			if (cqe.res < 0 || (cqe.flags & IORING_CQE_F_BUFFER) == 0 || !mRunning)
+				return;
+			const auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			const char * buffer = buffers.getBuffer(id);
+			const auto * out = reinterpret_cast<const io_uring_recvmsg_out *>(buffer);
+			shard.datagrams[pending] = UdpDatagram{buffer + headerSize, std::min<size_t>(out->payloadlen, capacity),
+					reinterpret_cast<const struct sockaddr *>(out + 1), std::min(out->namelen, shard.receiveHeader.msg_namelen),
+					(out->flags & MSG_TRUNC) != 0};
+			shard.bufferIds[pending++] = id;
+			if (pending == batch)
+				flush();
+		});
+		if (pending > 0)
+			flush();
+		if (error != 0 && mRunning) {
+			Log::error("UdpServer: io_uring receive failed, errno=%d", error);
 			break;
 		}
 	}
 }
 
+void UdpServer::cancelReceive(Shard & shard) {
+	// Its buffers stay with the shard, in case the kernel still completes into one while tearing the ring down
+	io_uring_sqe * sqe = shard.ring->getSqe();
+	if (sqe != nullptr) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = RING_RECEIVE;
+		sqe->user_data = RING_CANCEL;
+		bool cancelled = false;
+		while (!cancelled && shard.ring->submit(1) >= 0) {
+			shard.ring->reap([&](const io_uring_cqe & cqe) {
+				if (cqe.user_data == RING_CANCEL)
+					cancelled = true;
+			});
+		}
+	}
+	shard.ring.reset();
+}
+
+bool UdpServer::postReceive(Shard & shard) {
+	io_uring_sqe * sqe = shard.ring->getSqe();
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = shard.fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&shard.receiveHeader);
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = shard.buffers->getGroup();
+	sqe->user_data = RING_RECEIVE;
+	return true;
+}
+
+bool UdpServer::postWakeUp(Shard & shard) {
+	io_uring_sqe * sqe = shard.ring->getSqe();
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = shard.wakeFd;
+	sqe->addr = reinterpret_cast<uint64_t>(&shard.wakeValue);
+	sqe->len = sizeof(shard.wakeValue);
+	sqe->user_data = RING_WAKE_UP;
+	return true;
+}
+
+#else // built against uapi headers without what the rings need, see io_uring.h
+
+bool UdpServer::openRings() {
+	return false;
+}
+
+size_t UdpServer::sendThroughRing(UdpSendBatch &, int) {
+	return 0;
+}
+
+void UdpServer::readRing(Shard &) { }
+
+void UdpServer::cancelReceive(Shard & shard) {
+	shard.ring.reset();
+}
+
+bool UdpServer::postReceive(Shard &) {
+	return false;
+}
+
+bool UdpServer::postWakeUp(Shard &) {
+	return false;
+}
+
+#endif
+
+size_t UdpServer::getIdlePacketCount() const {
+	size_t idle = 0;
+	for (auto & shard : mShards)
+		idle += shard->pool->getIdleCount();
+	return idle;
+}
+
+bool UdpServer::receiveAvailable(Shard & shard) {
+	const size_t batch = shard.messages.size();
+	while (mRunning) {
+		const auto handlers = std::atomic_load_explicit(&mHandlers, std::memory_order_acquire);
+		const bool packetMode = static_cast<bool>(handlers->packet);
+		for (size_t i = 0; i < batch; i++) {
+			void * address = &shard.addresses[i];
+			if (packetMode) {
+				auto & packet = shard.packets[i];
+				if (!packet)
+					packet = shard.pool->acquire();
+				if (packet->capacity < mConfig.maxDatagramSize) {
+					packet->buffer = std::make_unique<char[]>(mConfig.maxDatagramSize);
+					packet->capacity = mConfig.maxDatagramSize;
+				}
+				shard.vectors[i].iov_base = packet->buffer.get();
+				address = &packet->address;
+			} else {
+				shard.vectors[i].iov_base = shard.buffer.get() + i * mConfig.maxDatagramSize;
+			}
+			shard.vectors[i].iov_len = mConfig.maxDatagramSize;
+			shard.messages[i].msg_hdr = {};
+			shard.messages[i].msg_hdr.msg_name = address;
+			shard.messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+			shard.messages[i].msg_hdr.msg_iov = &shard.vectors[i];
+			shard.messages[i].msg_hdr.msg_iovlen = 1;
+			shard.messages[i].msg_len = 0;
+		}
+		const int n = recvmmsg(shard.fd, shard.messages.data(), static_cast<unsigned int>(batch), MSG_DONTWAIT, nullptr);
+		if (n == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		if (packetMode)
+			dispatchPackets(shard, static_cast<size_t>(n), *handlers);
+		else
+			dispatch(shard, static_cast<size_t>(n), *handlers);
+		if (static_cast<size_t>(n) < batch)
+			return true; // drained
+	}
+	return true;
+}
+
+void UdpServer::dispatch(Shard & shard, size_t count, const Handlers & handlers) {
+	for (size_t i = 0; i < count; i++) {
+		const auto & header = shard.messages[i].msg_hdr;
+		shard.datagrams[i] = UdpDatagram{static_cast<const char *>(shard.vectors[i].iov_base), shard.messages[i].msg_len,
+				static_cast<const struct sockaddr *>(header.msg_name), header.msg_namelen, (header.msg_flags & MSG_TRUNC) != 0};
+	}
+	deliver(shard, count, handlers);
+}
+
+void UdpServer::deliver(Shard & shard, size_t count, const Handlers & handlers) {
+	if (handlers.packet) {
+		// Only from io_uring, whose buffers go back to the ring as soon as this returns
+		for (size_t i = 0; i < count; i++) {
+			const UdpDatagram & datagram = shard.datagrams[i];
+			auto packet = shard.pool->acquire();
+			if (packet->capacity < mConfig.maxDatagramSize) {
+				packet->buffer = std::make_unique<char[]>(mConfig.maxDatagramSize);
+				packet->capacity = mConfig.maxDatagramSize;
+			}
+			packet->length = std::min(datagram.length, packet->capacity);
+			memcpy(packet->buffer.get(), datagram.data, packet->length);
+			packet->addressLength = std::min<socklen_t>(datagram.addressLength, sizeof(packet->address));
+			memcpy(&packet->address, datagram.address, packet->addressLength);
+			packet->truncated = datagram.truncated;
+			handlers.packet(std::move(packet));
+		}
+		return;
+	}
+	if (handlers.batch) {
+		handlers.batch(shard.datagrams.data(), count);
+		return;
+	}
+	for (size_t i = 0; i < count; i++)
+		handlers.read(shard.datagrams[i].data, shard.datagrams[i].length);
+}
+
+void UdpServer::dispatchPackets(Shard & shard, size_t count, const Handlers & handlers) {
+	for (size_t i = 0; i < count; i++) {
+		auto & packet = shard.packets[i];
+		const auto & header = shard.messages[i].msg_hdr;
+		packet->length = shard.messages[i].msg_len;
+		packet->addressLength = header.msg_namelen;
+		packet->truncated = (header.msg_flags & MSG_TRUNC) != 0;
+		handlers.packet(std::move(packet)); // the slot gets a fresh packet before the next read
+	}
+}
+
 } // namespace jlcommon
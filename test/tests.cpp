@@ -1,9 +1,11 @@
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "cert-err58-cpp"
 #include <jlcommon.h>
+#include <io_uring.h>
 
 #include <gtest/gtest.h>
 #include <string>
+#include <set>
 #include <thread>
 #include <unistd.h>
 #include <chrono>
@@ -237,6 +239,330 @@ TEST(UdpServer, StandardCommunication) {
 	ASSERT_STREQ("Hello World", message);
 }
 
+TEST(UdpServer, BatchedReceive) {
+	jlcommon::UdpServerConfig config;
+	config.receiveBatch = 16;
+	jlcommon::UdpServer client(0);
+	jlcommon::UdpServer server(0, config);
+	
+	std::atomic_bool released{false};
+	std::atomic_size_t received{0};
+	std::atomic_size_t largestBatch{0};
+	std::atomic_int senderPort{0};
+	server.setBatchHandler([&](const jlcommon::UdpDatagram * datagrams, size_t count) {
+		while (!released)
+			std::this_thread::yield(); // hold the reader so that the rest piles up in the socket
+		for (size_t i = 0; i < count; i++) {
+			ASSERT_EQ(sizeof(int), datagrams[i].length);
+			ASSERT_FALSE(datagrams[i].truncated);
+			senderPort = ntohs(reinterpret_cast<const struct sockaddr_in *>(datagrams[i].address)->sin_port);
+		}
+		if (count > largestBatch)
+			largestBatch = count;
+		received += count;
+	});
+	usleep(10000);
+	jlcommon::InetAddress addr = jlcommon::InetAddress::getLocalHost(server.getPort());
+	for (int i = 0; i < 50; i++)
+		client.send(addr, &i, sizeof(i));
+	released = true;
+	WAIT_FOR_TRUE((received == 50))
+	ASSERT_EQ(50, received);
+	ASSERT_GT(largestBatch, 1);
+	ASSERT_LE(largestBatch, 16);
+	ASSERT_EQ(client.getPort(), senderPort);
+}
+
+TEST(UdpServer, PooledPackets) {
+	jlcommon::UdpServerConfig config;
+	config.receiveBatch = 8;
+	jlcommon::UdpServer client(0);
+	jlcommon::UdpServer server(0, config);
+	
+	std::mutex lock;
+	std::vector<std::shared_ptr<jlcommon::UdpPacket>> kept;
+	server.setPacketHandler([&](std::shared_ptr<jlcommon::UdpPacket> packet) {
+		std::lock_guard<std::mutex> guard(lock);
+		kept.emplace_back(std::move(packet));
+	});
+	usleep(10000);
+	jlcommon::InetAddress addr = jlcommon::InetAddress::getLocalHost(server.getPort());
+	auto sendRound = [&]() {
+		for (int i = 0; i < 20; i++)
+			client.send(addr, &i, sizeof(i));
+		WAIT_FOR_TRUE((std::lock_guard<std::mutex>(lock), kept.size() == 20))
+		std::lock_guard<std::mutex> guard(lock);
+		ASSERT_EQ(20, kept.size());
+		std::set<int> values;
+		for (auto & packet : kept) {
+			ASSERT_EQ(sizeof(int), packet->length);
+			ASSERT_FALSE(packet->truncated);
+			ASSERT_EQ(client.getPort(), ntohs(reinterpret_cast<const struct sockaddr_in *>(packet->getAddress())->sin_port));
+			values.insert(*reinterpret_cast<const int *>(packet->data()));
+		}
+		ASSERT_EQ(20, values.size()); // every packet kept its own payload
+	};
+	
+	sendRound();
+	std::vector<const char *> firstBuffers;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (auto & packet : kept)
+			firstBuffers.push_back(packet->data());
+		std::thread([packets = std::move(kept)]() mutable { packets.clear(); }).join(); // released on another thread
+		kept.clear();
+	}
+	ASSERT_EQ(20, server.getIdlePacketCount());
+	
+	sendRound();
+	std::lock_guard<std::mutex> guard(lock);
+	size_t reused = 0;
+	for (auto & packet : kept)
+		reused += std::count(firstBuffers.begin(), firstBuffers.end(), packet->data());
+	ASSERT_GE(reused, 20 - config.receiveBatch); // the reader already holds up to a batch of packets for its next read
+}
+
+TEST(UdpServer, ReplaceHandlers) {
+	jlcommon::UdpServerConfig config;
+	config.receiveBatch = 4;
+	jlcommon::UdpServer client(0);
+	jlcommon::UdpServer server(0, config);
+	
+	std::atomic_size_t read{0};
+	std::atomic_size_t packets{0};
+	server.setHandler([&](const char *, size_t){ read++; });
+	usleep(10000);
+	jlcommon::InetAddress addr = jlcommon::InetAddress::getLocalHost(server.getPort());
+	std::atomic_bool sending{true};
+	std::thread sender([&]() {
+		for (int i = 0; sending; i++) {
+			client.send(addr, &i, sizeof(i));
+			usleep(100);
+		}
+	});
+	WAIT_FOR_TRUE((read > 0))
+	server.setPacketHandler([&](std::shared_ptr<jlcommon::UdpPacket> packet) {
+		if (packet->length == sizeof(int))
+			packets++;
+	}); // while datagrams keep arriving
+	WAIT_FOR_TRUE((packets > 0))
+	const size_t readAfterSwitch = read;
+	WAIT_FOR_TRUE((packets > 10))
+	sending = false;
+	sender.join();
+	ASSERT_GT(read, 0);
+	ASSERT_GT(packets, 10);
+	ASSERT_EQ(readAfterSwitch, read); // the packet handler took over for good
+}
+
+TEST(UdpServer, BatchedSend) {
+	jlcommon::UdpServerConfig config;
+	config.receiveBatch = 16;
+	config.maxDatagramSize = 2048;
+	jlcommon::UdpServer client(0);
+	jlcommon::UdpServer server(0, config);
+	std::atomic_size_t received{0};
+	std::atomic_size_t receivedBytes{0};
+	server.setBatchHandler([&](const jlcommon::UdpDatagram * datagrams, size_t count) {
+		for (size_t i = 0; i < count; i++)
+			receivedBytes += datagrams[i].length;
+		received += count;
+	});
+	usleep(10000);
+	
+	jlcommon::InetAddress addr = jlcommon::InetAddress::getLocalHost(server.getPort());
+	jlcommon::InetAddress unreachable = jlcommon::InetAddress::getLocalHost(0);
+	std::vector<char> large(2500, 'x');
+	int values[10];
+	jlcommon::UdpSendBatch batch;
+	for (int i = 0; i < 10; i++) {
+		values[i] = i;
+		batch.add(addr, &values[i], sizeof(int));
+		if (i == 4)
+			batch.add(unreachable, &values[i], sizeof(int));
+	}
+	ASSERT_TRUE(batch.addSegmented(addr, large.data(), large.size(), 1000));
+	ASSERT_FALSE(batch.addSegmented(addr, large.data(), large.size(), 10)); // more than MAX_SEGMENTS
+	ASSERT_EQ(12, batch.size());
+	
+	// One failure doesn't stop the rest of the batch
+	ASSERT_EQ(11, client.send(batch));
+	const auto & results = batch.getResults();
+	ASSERT_EQ(12, results.size());
+	ASSERT_LT(results[5], 0);
+	ASSERT_EQ(sizeof(int), results[6]);
+	ASSERT_EQ(2500, results[11]);
+	// The segmented payload arrives as three datagrams
+	WAIT_FOR_TRUE((received == 13))
+	ASSERT_EQ(13, received);
+	ASSERT_EQ(10 * sizeof(int) + 2500, receivedBytes);
+}
+
+TEST(UdpServer, ShardedReceive) {
+	cpu_set_t allowed;
+	ASSERT_EQ(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &allowed))
+		cpu++;
+	
+	jlcommon::UdpServerConfig config;
+	config.shards = 4;
+	config.shardCpus = {cpu};
+	config.steerByPeerAddress = true;
+	jlcommon::UdpServer server(0, config);
+	ASSERT_EQ(4, server.getShardCount());
+	
+	std::mutex lock;
+	std::set<std::thread::id> readers;
+	std::atomic_int received{0};
+	std::atomic_bool pinned{true};
+	server.setHandler([&](const char * data, size_t len) {
+		if (sched_getcpu() != cpu)
+			pinned = false;
+		std::lock_guard<std::mutex> lk(lock);
+		readers.insert(std::this_thread::get_id());
+		received++;
+	});
+	usleep(10000);
+	
+	// Every client shares the same address, so the steering program sends them all to the same shard
+	jlcommon::InetAddress addr = jlcommon::InetAddress::getLocalHost(server.getPort());
+	std::vector<std::unique_ptr<jlcommon::UdpServer>> clients;
+	for (int i = 0; i < 8; i++) {
+		clients.emplace_back(std::make_unique<jlcommon::UdpServer>(0));
+		clients.back()->send(addr, &i, sizeof(i));
+	}
+	WAIT_FOR_TRUE((received == 8))
+	ASSERT_EQ(8, received);
+	ASSERT_EQ(1, readers.size());
+	ASSERT_TRUE(pinned);
+}
+
+TEST(UdpServer, IoUring) {
+	if (!jlcommon::IoUring(2).isOpen())
+		GTEST_SKIP() << "io_uring is unavailable";
+	jlcommon::UdpServerConfig config;
+	config.receiveBatch = 16;
+	config.useIoUring = true;
+	config.ioUringBuffers = 64;
+	jlcommon::UdpServer client(0, config);
+	jlcommon::UdpServer server(0, config);
+	ASSERT_TRUE(client.isUsingIoUring());
+	ASSERT_TRUE(server.isUsingIoUring());
+	
+	std::mutex lock;
+	std::set<int> values;
+	std::atomic_int senderPort{0};
+	server.setBatchHandler([&](const jlcommon::UdpDatagram * datagrams, size_t count) {
+		std::lock_guard<std::mutex> guard(lock);
+		for (size_t i = 0; i < count; i++) {
+			ASSERT_EQ(sizeof(int), datagrams[i].length);
+			ASSERT_FALSE(datagrams[i].truncated);
+			senderPort = ntohs(reinterpret_cast<const struct sockaddr_in *>(datagrams[i].address)->sin_port);
+			values.insert(*reinterpret_cast<const int *>(datagrams[i].data));
+		}
+	});
+	usleep(10000);
+	// More datagrams than buffers, which are recycled as they are consumed
+	jlcommon::InetAddress addr = jlcommon::InetAddress::getLocalHost(server.getPort());
+	std::vector<int> payloads(200);
+	jlcommon::UdpSendBatch batch(payloads.size());
+	for (size_t i = 0; i < payloads.size(); i++) {
+		payloads[i] = static_cast<int>(i);
+		batch.add(addr, &payloads[i], sizeof(int));
+	}
+	ASSERT_EQ(payloads.size(), client.send(batch));
+	for (auto result : batch.getResults())
+		ASSERT_EQ(static_cast<ssize_t>(sizeof(int)), result);
+	WAIT_FOR_TRUE((std::lock_guard<std::mutex>(lock), values.size() == payloads.size()))
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		ASSERT_EQ(payloads.size(), values.size());
+	}
+	ASSERT_EQ(client.getPort(), senderPort);
+	
+	std::atomic_int kept{-1};
+	std::shared_ptr<jlcommon::UdpPacket> packet;
+	server.setPacketHandler([&](std::shared_ptr<jlcommon::UdpPacket> received) {
+		packet = std::move(received);
+		kept = *reinterpret_cast<const int *>(packet->data());
+	});
+	int value = 7;
+	client.send(addr, &value, sizeof(value));
+	WAIT_FOR_TRUE((kept == 7))
+	ASSERT_EQ(7, kept);
+	ASSERT_EQ(sizeof(int), packet->length);
+}
+
+TEST(EventLoop, Timers) {
+	jlcommon::EventLoop loop;
+	std::atomic_int periodic{0};
+	std::atomic_int once{0};
+	std::atomic_int cancelled{0};
+	std::atomic_bool inLoop{false};
+	loop.addTimer(std::chrono::milliseconds(5), std::chrono::milliseconds(5), [&]() {
+		inLoop = loop.isInLoopThread();
+		periodic++;
+	});
+	loop.addTimer(std::chrono::milliseconds(1), std::chrono::milliseconds(0), [&]() { once++; });
+	const uint64_t id = loop.addTimer(std::chrono::milliseconds(100), std::chrono::milliseconds(0), [&]() { cancelled++; });
+	ASSERT_NE(0, id);
+	loop.remove(id);
+	WAIT_FOR_TRUE((periodic >= 5))
+	usleep(150000);
+	ASSERT_GE(periodic, 5);
+	ASSERT_EQ(1, once);
+	ASSERT_EQ(0, cancelled);
+	ASSERT_TRUE(inLoop);
+	ASSERT_FALSE(loop.isInLoopThread());
+}
+
+TEST(UdpServer, EventLoop) {
+	jlcommon::UdpServerConfig config;
+	config.receiveBatch = 8;
+	config.eventLoop = std::make_shared<jlcommon::EventLoop>(1);
+	jlcommon::UdpServer client(0);
+	
+	std::mutex lock;
+	std::set<std::thread::id> threads;
+	std::atomic_int received{0};
+	std::vector<std::unique_ptr<jlcommon::UdpServer>> servers;
+	for (int i = 0; i < 20; i++) {
+		servers.emplace_back(std::make_unique<jlcommon::UdpServer>(0, config));
+		servers.back()->setHandler([&](const char * buffer, size_t len) {
+			ASSERT_EQ(sizeof(int), len);
+			(void) buffer;
+			std::lock_guard<std::mutex> guard(lock);
+			threads.insert(std::this_thread::get_id());
+			received++;
+		});
+	}
+	usleep(10000);
+	for (auto & server : servers) {
+		jlcommon::InetAddress addr = jlcommon::InetAddress::getLocalHost(server->getPort());
+		for (int i = 0; i < 10; i++)
+			client.send(addr, &i, sizeof(i));
+	}
+	WAIT_FOR_TRUE((received == 200))
+	ASSERT_EQ(200, received);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		ASSERT_EQ(1, threads.size()); // every socket served by the loop's single thread
+		ASSERT_EQ(0, threads.count(std::this_thread::get_id()));
+	}
+	
+	// Servers leave the loop on destruction, while the rest keep receiving
+	servers.resize(10);
+	received = 0;
+	for (auto & server : servers) {
+		jlcommon::InetAddress addr = jlcommon::InetAddress::getLocalHost(server->getPort());
+		const int value = 0;
+		client.send(addr, &value, sizeof(value));
+	}
+	WAIT_FOR_TRUE((received == 10))
+	ASSERT_EQ(10, received);
+}
+
 class Point {
 	public:
 	explicit Point(int x): x(x) {}
@@ -290,6 +616,604 @@ TEST(TestIntentManager, TestStartStop) {
 	ASSERT_EQ(2, value);
 }
 
+template<int N>
+class NumberedIntent {
+	public:
+	explicit NumberedIntent(int value): value(value) {}
+	int value;
+};
+
+TEST(TestIntentManager, TestTypeDispatch) {
+	auto im = jlcommon::IntentManager{};
+	int first = 0;
+	int second = 0;
+	im.subscribe<NumberedIntent<1>>([&](const auto & i) { first += i.value; });
+	im.subscribe<NumberedIntent<2>>([&](const auto & i) { second += i.value; });
+	im.subscribe<NumberedIntent<2>>([&](const auto & i) { second += i.value; });
+
+	const auto lvalue = NumberedIntent<1>{5};
+	ASSERT_EQ(1, im.broadcast(lvalue));
+	ASSERT_EQ(2, im.broadcast(NumberedIntent<2>{3}));
+	ASSERT_EQ(0, im.broadcast(NumberedIntent<3>{7}));
+	im.runUntilEmpty();
+	ASSERT_EQ(5, first);
+	ASSERT_EQ(6, second);
+}
+
+class CopyCountingIntent {
+	public:
+	CopyCountingIntent() = default;
+	CopyCountingIntent(const CopyCountingIntent & intent) : payload(intent.payload) { ++copies; }
+	CopyCountingIntent(CopyCountingIntent && intent) noexcept : payload(std::move(intent.payload)) { }
+	
+	std::vector<int> payload = std::vector<int>(1024, 1);
+	
+	static std::atomic_int copies;
+};
+
+std::atomic_int CopyCountingIntent::copies = 0;
+
+TEST(TestIntentManager, TestSharedPayload) {
+	auto im = jlcommon::IntentManager{};
+	std::vector<const CopyCountingIntent *> received;
+	for (int i = 0; i < 20; i++)
+		im.subscribe<CopyCountingIntent>([&](const auto & intent) { received.emplace_back(&intent); });
+	ASSERT_EQ(20, im.broadcast(CopyCountingIntent{}));
+	im.runUntilEmpty();
+	ASSERT_EQ(0, static_cast<int>(CopyCountingIntent::copies));
+	ASSERT_EQ(20, received.size());
+	for (auto intent : received)
+		ASSERT_EQ(received.front(), intent);
+}
+
+TEST(TestIntentManager, TestParallelStrands) {
+	constexpr int SUBSCRIBERS = 4;
+	constexpr int INTENTS = 2000;
+	auto im = jlcommon::IntentManager{4};
+	std::atomic_int concurrent[SUBSCRIBERS] = {};
+	std::atomic_bool overlapped{false};
+	std::vector<int> received[SUBSCRIBERS];
+	for (int s = 0; s < SUBSCRIBERS; s++) {
+		im.subscribe<NumberedIntent<4>>("service-" + std::to_string(s), [&, s](const auto & i) {
+			if (concurrent[s]++ != 0)
+				overlapped = true;
+			received[s].push_back(i.value);
+			concurrent[s]--;
+		});
+	}
+	for (int i = 0; i < INTENTS; i++)
+		ASSERT_EQ(SUBSCRIBERS, im.broadcast(NumberedIntent<4>{i}));
+	im.runUntilEmpty();
+	ASSERT_FALSE(overlapped);
+	for (auto & values : received) {
+		ASSERT_EQ(INTENTS, values.size());
+		for (int i = 0; i < INTENTS; i++)
+			ASSERT_EQ(i, values[i]);
+	}
+	
+	// Anonymous subscribers don't share a strand: each waits until the other is running too
+	std::atomic_int running{0};
+	std::atomic_int met{0};
+	for (int s = 0; s < 2; s++) {
+		im.subscribe<NumberedIntent<23>>([&](const auto & i) {
+			running++;
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+			while (running < 2 && std::chrono::steady_clock::now() < deadline)
+				std::this_thread::yield();
+			if (running == 2)
+				met++;
+		});
+	}
+	ASSERT_EQ(2, im.broadcast(NumberedIntent<23>{0}));
+	im.runUntilEmpty();
+	ASSERT_EQ(2, met);
+	
+	im.stop();
+	im.broadcast(NumberedIntent<4>{INTENTS});
+	im.runUntilEmpty(); // returns rather than waiting for the stopped workers
+}
+
+TEST(TestIntentManager, TestCoalescing) {
+	auto im = jlcommon::IntentManager{};
+	int calls = 0;
+	int latest = -1;
+	int uncoalesced = 0;
+	im.setCoalescing<NumberedIntent<5>>(true);
+	im.subscribe<NumberedIntent<5>>([&](const auto & i) { calls++; latest = i.value; });
+	im.subscribe<NumberedIntent<6>>([&](const auto & i) { uncoalesced++; });
+	for (int i = 0; i < 1000; i++) {
+		ASSERT_EQ(1, im.broadcast(NumberedIntent<5>{i}));
+		im.broadcast(NumberedIntent<6>{i});
+	}
+	im.runUntilEmpty();
+	ASSERT_EQ(1, calls);
+	ASSERT_EQ(999, latest);
+	ASSERT_EQ(1000, uncoalesced);
+	
+	im.broadcast(NumberedIntent<5>{1000});
+	im.runUntilEmpty();
+	ASSERT_EQ(2, calls);
+	ASSERT_EQ(1000, latest);
+}
+
+TEST(LatencyHistogram, Percentiles) {
+	jlcommon::LatencyHistogram histogram;
+	for (uint64_t i = 1; i <= 1000; i++)
+		histogram.record(i * 1000);
+	auto snapshot = histogram.snapshot();
+	ASSERT_EQ(1000, snapshot.count);
+	ASSERT_EQ(500500, snapshot.mean);
+	ASSERT_EQ(1000000, snapshot.max);
+	ASSERT_NEAR(500000, snapshot.p50, 500000 * 0.07);
+	ASSERT_NEAR(990000, snapshot.p99, 990000 * 0.07);
+	ASSERT_LE(snapshot.p999, snapshot.max);
+	ASSERT_EQ(0, jlcommon::LatencyHistogram{}.snapshot().p99);
+}
+
+TEST(TestIntentManager, TestTimingSnapshot) {
+	auto im = jlcommon::IntentManager{};
+	im.subscribe<NumberedIntent<7>>("timed", [](const auto & i) { usleep(1000); });
+	im.broadcast(NumberedIntent<7>{0});
+	im.broadcast(NumberedIntent<7>{1});
+	im.runUntilEmpty();
+	auto snapshots = im.getIntentTimingSnapshot();
+	auto timed = std::find_if(snapshots.begin(), snapshots.end(), [](const auto & s) { return s.subscriber == "timed"; });
+	ASSERT_NE(snapshots.end(), timed);
+	ASSERT_EQ(2, timed->runTime.count);
+	ASSERT_GE(timed->runTime.p50, 1000000);
+	ASSERT_EQ(2, timed->queueWait.count);
+	ASSERT_GE(timed->queueWait.max, 1000000); // the second intent waited behind the first
+}
+
+TEST(TestIntentManager, TestTimingModes) {
+	auto getCount = [](const jlcommon::IntentManager & im) -> uint64_t {
+		for (auto & snapshot : im.getIntentTimingSnapshot())
+			if (snapshot.subscriber == "sampled")
+				return snapshot.runTime.count;
+		return 0;
+	};
+	auto getWaits = [](const jlcommon::IntentManager & im) -> uint64_t {
+		for (auto & snapshot : im.getIntentTimingSnapshot())
+			if (snapshot.subscriber == "sampled")
+				return snapshot.queueWait.count;
+		return 0;
+	};
+	auto im = jlcommon::IntentManager{};
+	im.setIntentTiming(jlcommon::IntentTimingMode::OFF);
+	im.subscribe<NumberedIntent<8>>("sampled", [](const auto & i) { });
+	for (int i = 0; i < 1000; i++)
+		im.broadcast(NumberedIntent<8>{i});
+	im.runUntilEmpty();
+	ASSERT_EQ(0, getCount(im));
+	
+	im.setIntentTiming(jlcommon::IntentTimingMode::SAMPLED, 10);
+	for (int i = 0; i < 10000; i++)
+		im.broadcast(NumberedIntent<8>{i});
+	im.runUntilEmpty();
+#ifndef JLCOMMON_DISABLE_INTENT_TIMING
+	ASSERT_GT(getCount(im), 500);
+	ASSERT_LT(getCount(im), 2000);
+	ASSERT_GT(getWaits(im), 500); // one in ten broadcasts, not one in a hundred
+	ASSERT_LT(getWaits(im), 2000);
+	
+	const auto sampled = getCount(im);
+	im.setIntentTiming(jlcommon::IntentTimingMode::FULL);
+	for (int i = 0; i < 1000; i++)
+		im.broadcast(NumberedIntent<8>{i});
+	im.runUntilEmpty();
+	ASSERT_EQ(sampled + 1000, getCount(im));
+#endif
+}
+
+TEST(TestIntentManager, TestInlineDispatch) {
+	int exceptions = 0;
+	jlcommon::Log::addWrapper([&exceptions](auto str) { exceptions++; });
+	auto im = jlcommon::IntentManager{};
+	int inlineValue = 0;
+	int queuedValue = 0;
+	im.subscribeInline<NumberedIntent<9>>("inline", [&](const auto & i) { inlineValue = i.value; });
+	im.subscribeInline<NumberedIntent<9>>("throws", [&](const auto & i) { throw std::string("Testing String"); });
+	im.subscribe<NumberedIntent<9>>("queued", [&](const auto & i) { queuedValue = i.value; });
+	ASSERT_EQ(3, im.broadcast(NumberedIntent<9>{4}));
+	ASSERT_EQ(4, inlineValue);
+	ASSERT_EQ(0, queuedValue);
+	ASSERT_EQ(1, exceptions);
+	im.runUntilEmpty();
+	ASSERT_EQ(4, queuedValue);
+	jlcommon::Log::clearWrappers();
+	
+	auto snapshots = im.getIntentTimingSnapshot();
+	auto timed = std::find_if(snapshots.begin(), snapshots.end(), [](const auto & s) { return s.subscriber == "inline"; });
+	ASSERT_NE(snapshots.end(), timed);
+#ifndef JLCOMMON_DISABLE_INTENT_TIMING
+	ASSERT_EQ(1, timed->runTime.count);
+#endif
+}
+
+TEST(TestIntentManager, TestConcurrentSubscriptions) {
+	auto im = jlcommon::IntentManager{2};
+	std::atomic_bool running{true};
+	std::atomic_int permanentCalls{0};
+	std::atomic_int churnCalls{0};
+	im.subscribeInline<NumberedIntent<10>>("permanent", [&](const auto & i) { permanentCalls++; });
+	std::thread broadcaster([&] {
+		while (running)
+			im.broadcast(NumberedIntent<10>{0});
+	});
+	for (int i = 0; i < 500; i++) {
+		auto queued = im.subscribe<NumberedIntent<10>>("churn", [&](const auto & i) { churnCalls++; });
+		auto inlined = im.subscribeInline<NumberedIntent<10>>("churn-inline", [&](const auto & i) { churnCalls++; });
+		ASSERT_TRUE(queued.isValid());
+		ASSERT_TRUE(im.unsubscribe(queued));
+		ASSERT_TRUE(im.unsubscribe(inlined));
+		ASSERT_FALSE(im.unsubscribe(inlined));
+	}
+	running = false;
+	broadcaster.join();
+	im.runUntilEmpty();
+	
+	const int churned = churnCalls;
+	ASSERT_EQ(1, im.broadcast(NumberedIntent<10>{0}));
+	im.runUntilEmpty();
+	ASSERT_EQ(churned, churnCalls);
+	ASSERT_GT(permanentCalls, 0);
+}
+
+TEST(TestIntentManager, TestPriority) {
+	auto im = jlcommon::IntentManager{};
+	std::vector<int> order;
+	im.setPriority<NumberedIntent<12>>(jlcommon::IntentPriority::HIGH);
+	im.subscribe<NumberedIntent<11>>("bulk", [&](const auto & i) { order.push_back(11); });
+	im.subscribe<NumberedIntent<12>>("heartbeat", [&](const auto & i) { order.push_back(12); });
+	im.subscribe<NumberedIntent<13>>("shutdown", [&](const auto & i) { order.push_back(13); }, jlcommon::IntentPriority::CRITICAL);
+	for (int i = 0; i < 10; i++)
+		im.broadcast(NumberedIntent<11>{i});
+	im.broadcast(NumberedIntent<12>{0});
+	im.broadcast(NumberedIntent<13>{0});
+	ASSERT_TRUE(im.run());
+	ASSERT_TRUE(im.run());
+	ASSERT_EQ((std::vector<int>{13, 12}), order);
+	im.runUntilEmpty();
+	ASSERT_EQ(12, order.size());
+}
+
+TEST(BlockingQueueTest, MultiLevelBlockingQueueStarvation) {
+	struct Level { size_t operator()(int item) const { return item; } };
+	jlcommon::MultiLevelBlockingQueue<int, 2, Level, 8> q;
+	q.add(0);
+	for (int i = 0; i < 100; i++)
+		q.add(1);
+	int position = 0;
+	while (q.take() != 0)
+		position++;
+	ASSERT_EQ(8, position);
+	ASSERT_EQ(92, q.size());
+}
+
+TEST(Trace, ChromeTraceExport) {
+	auto im = jlcommon::IntentManager{};
+	im.subscribe<NumberedIntent<14>>("traced-service", [](const auto & i) { });
+	im.broadcast(NumberedIntent<14>{0});
+	im.runUntilEmpty();
+	ASSERT_EQ(std::string::npos, jlcommon::Trace::getChromeTraceJson().find("traced-service"));
+	
+	jlcommon::Trace::enable(16);
+	auto threadPool = std::make_unique<jlcommon::FifoThreadPool<std::function<void()>>>(1);
+	threadPool->start();
+	bool ran = false;
+	threadPool->execute([&ran]{ ran = true; });
+	for (int i = 0; i < 100; i++)
+		im.broadcast(NumberedIntent<14>{i});
+	im.runUntilEmpty();
+	WAIT_FOR_TRUE(ran)
+	threadPool->stop();
+	jlcommon::Trace::disable();
+	
+	const auto json = jlcommon::Trace::getChromeTraceJson();
+	ASSERT_EQ(0, json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+	ASSERT_NE(std::string::npos, json.find("traced-service\",\"cat\":\"intent\",\"ph\":\"X\""));
+	ASSERT_NE(std::string::npos, json.find("\"cat\":\"FifoThreadPool\""));
+	size_t intentEvents = 0;
+	for (size_t pos = json.find("traced-service"); pos != std::string::npos; pos = json.find("traced-service", pos + 1))
+		intentEvents++;
+	ASSERT_EQ(16, intentEvents); // bounded by the per-thread ring
+	jlcommon::Trace::clear();
+}
+
+TEST(Trace, ExitedThreads) {
+	jlcommon::Trace::enable(4);
+	for (int i = 0; i < 3; i++) {
+		std::thread([]{
+			for (int j = 0; j < 3; j++)
+				jlcommon::Trace::Span span("test", "exited-thread");
+		}).join();
+	}
+	jlcommon::Trace::disable();
+	
+	const auto json = jlcommon::Trace::getChromeTraceJson();
+	size_t events = 0;
+	for (size_t pos = json.find("exited-thread"); pos != std::string::npos; pos = json.find("exited-thread", pos + 1))
+		events++;
+	ASSERT_EQ(3, events); // the last thread's spans, since exited threads keep one ring's worth in total
+	jlcommon::Trace::clear();
+	ASSERT_EQ(std::string::npos, jlcommon::Trace::getChromeTraceJson().find("exited-thread"));
+}
+
+class PooledIntent {
+	public:
+	std::vector<int> samples;
+};
+
+TEST(TestIntentManager, TestPooledPayload) {
+	auto pool = jlcommon::IntentPool<PooledIntent>{};
+	auto im = jlcommon::IntentManager{};
+	size_t received = 0;
+	im.subscribe<PooledIntent>("first", [&](const auto & i) { received += i.samples.size(); });
+	im.subscribe<PooledIntent>("second", [&](const auto & i) { received += i.samples.size(); });
+	
+	const PooledIntent * previous = nullptr;
+	for (int round = 0; round < 3; round++) {
+		auto intent = pool.acquire();
+		if (previous != nullptr) {
+			ASSERT_EQ(previous, intent.get()); // recycled, with its capacity intact
+			ASSERT_GE(intent->samples.capacity(), 512);
+		}
+		previous = intent.get();
+		intent->samples.assign(512, round);
+		ASSERT_EQ(2, im.broadcastShared(std::move(intent)));
+		ASSERT_EQ(0, pool.getIdleCount());
+		im.runUntilEmpty();
+		ASSERT_EQ(1, pool.getIdleCount());
+	}
+	ASSERT_EQ(3 * 2 * 512, received);
+}
+
+TEST(TestIntentManager, TestSharedMemoryBus) {
+	const std::string name = "/jlcommon-test-" + std::to_string(getpid());
+	auto first = std::make_shared<jlcommon::IntentManager>();
+	auto second = std::make_shared<jlcommon::IntentManager>();
+	// Two mappings of the same segment behave exactly like two processes
+	jlcommon::SharedMemoryIntentBus firstBus(first, name, 256, 64);
+	jlcommon::SharedMemoryIntentBus secondBus(second, name, 256, 64);
+	jlcommon::SharedMemoryIntentBus::unlink(name);
+	ASSERT_TRUE(firstBus.isOpen());
+	ASSERT_TRUE(secondBus.isOpen());
+	ASSERT_TRUE(firstBus.forward<NumberedIntent<15>>(15));
+	ASSERT_TRUE(secondBus.forward<NumberedIntent<15>>(15));
+	ASSERT_FALSE(firstBus.forward<NumberedIntent<15>>(15)); // would publish everything twice
+	ASSERT_FALSE(firstBus.forward<NumberedIntent<14>>(15));
+	ASSERT_TRUE(firstBus.start());
+	ASSERT_TRUE(secondBus.start());
+	
+	std::atomic_int firstSum{0};
+	std::atomic_int secondSum{0};
+	first->subscribeInline<NumberedIntent<15>>("first", [&](const auto & i) { firstSum += i.value; });
+	second->subscribeInline<NumberedIntent<15>>("second", [&](const auto & i) { secondSum += i.value; });
+	
+	for (int i = 1; i <= 100; i++)
+		first->broadcast(NumberedIntent<15>(i));
+	WAIT_FOR_TRUE((secondSum == 5050));
+	ASSERT_EQ(5050, secondSum);
+	ASSERT_EQ(5050, firstSum); // only the local broadcasts, nothing echoed back
+	
+	second->broadcast(NumberedIntent<15>(7));
+	WAIT_FOR_TRUE((firstSum == 5057));
+	usleep(10000);
+	ASSERT_EQ(5057, firstSum);
+	ASSERT_EQ(5057, secondSum);
+	ASSERT_EQ(0, firstBus.getDroppedCount());
+	ASSERT_EQ(0, secondBus.getDroppedCount());
+}
+
+TEST(TestIntentManager, TestRecordReplay) {
+	const std::string path = "/tmp/jlcommon-recording-" + std::to_string(getpid()) + ".bin";
+	auto source = std::make_shared<jlcommon::IntentManager>();
+	{
+		jlcommon::IntentRecorder recorder(source);
+		ASSERT_TRUE(recorder.record<NumberedIntent<16>>(16));
+		ASSERT_TRUE(recorder.record<std::string>(17, [](const std::string & intent, std::string & out) { out = intent; }));
+		ASSERT_TRUE(recorder.start(path));
+		source->broadcast(NumberedIntent<16>(1));
+		source->broadcast(std::string("hello"));
+		std::this_thread::sleep_for(std::chrono::milliseconds(40));
+		source->broadcast(NumberedIntent<16>(2));
+		recorder.stop();
+		source->broadcast(NumberedIntent<16>(100)); // not recorded
+		ASSERT_EQ(3, recorder.getRecordCount());
+	}
+	
+	auto target = std::make_shared<jlcommon::IntentManager>();
+	int sum = 0;
+	std::string text;
+	target->subscribeInline<NumberedIntent<16>>("replay", [&](const auto & i) { sum += i.value; });
+	target->subscribeInline<std::string>("replay", [&](const auto & s) { text = s; });
+	jlcommon::IntentReplayer replayer(target);
+	replayer.replay<NumberedIntent<16>>(16);
+	ASSERT_EQ(2, replayer.run(path, jlcommon::IntentReplayer::AS_FAST_AS_POSSIBLE)); // strings are not registered yet
+	ASSERT_EQ(3, sum);
+	
+	replayer.replay<std::string>(17, [](const char * data, size_t size) { return std::string(data, size); });
+	auto start = std::chrono::steady_clock::now();
+	ASSERT_EQ(3, replayer.run(path, 1));
+	ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(40));
+	ASSERT_EQ(6, sum);
+	ASSERT_EQ("hello", text);
+	
+	start = std::chrono::steady_clock::now();
+	ASSERT_EQ(3, replayer.run(path, 4));
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	ASSERT_GE(elapsed, std::chrono::milliseconds(10));
+	ASSERT_LT(elapsed, std::chrono::milliseconds(40));
+	
+	replayer.stop(); // before run() starts
+	ASSERT_EQ(0, replayer.run(path, jlcommon::IntentReplayer::AS_FAST_AS_POSSIBLE));
+	replayer.reset();
+	ASSERT_EQ(3, replayer.run(path, jlcommon::IntentReplayer::AS_FAST_AS_POSSIBLE));
+	
+	FILE * corrupt = fopen(path.c_str(), "wb");
+	const unsigned char record[] = {'J', 'L', 'C', 'I', 'N', 'T', 'R', '1', 0, 16, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F};
+	fwrite(record, sizeof(record), 1, corrupt);
+	fclose(corrupt);
+	ASSERT_EQ(0, replayer.run(path, jlcommon::IntentReplayer::AS_FAST_AS_POSSIBLE)); // claims 4 GiB
+	
+	// Broadcasts of another thread may still be recording while a recorder stops and goes away
+	std::atomic_bool broadcasting{true};
+	std::thread broadcaster([&]() {
+		while (broadcasting)
+			source->broadcast(NumberedIntent<16>(1));
+	});
+	for (int i = 0; i < 20; i++) {
+		jlcommon::IntentRecorder recorder(source);
+		ASSERT_TRUE(recorder.record<NumberedIntent<16>>(16));
+		ASSERT_TRUE(recorder.start(path));
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	broadcasting = false;
+	broadcaster.join();
+	unlink(path.c_str());
+}
+
+TEST(TestIntentManager, TestQueueLimits) {
+	auto im = jlcommon::IntentManager{};
+	std::vector<int> slow;
+	std::vector<int> fast;
+	im.subscribe<NumberedIntent<18>>("slow", [&](const auto & i) { slow.push_back(i.value); });
+	im.subscribe<NumberedIntent<18>>("fast", [&](const auto & i) { fast.push_back(i.value); });
+	im.setQueueLimit<NumberedIntent<18>>(2, jlcommon::IntentOverflowPolicy::DROP_NEWEST);
+	ASSERT_TRUE(im.setQueueLimit<NumberedIntent<18>>("slow", 1, jlcommon::IntentOverflowPolicy::DROP_OLDEST));
+	for (int i = 1; i <= 4; i++) {
+		auto result = im.broadcast(NumberedIntent<18>(i));
+		ASSERT_FALSE(result.rejected);
+		ASSERT_EQ(i <= 2 ? 2 : 1, result.handlers); // only the drop-oldest subscriber accepts the last two
+		ASSERT_EQ(i == 1 ? 0 : (i == 2 ? 1 : 2), result.dropped);
+	}
+	im.runUntilEmpty();
+	ASSERT_EQ(std::vector<int>({4}), slow);
+	ASSERT_EQ(std::vector<int>({1, 2}), fast);
+	
+	uint64_t dropped = 0;
+	for (auto & stats : im.getIntentQueueStats()) {
+		ASSERT_EQ(0, stats.pending);
+		dropped += stats.dropped;
+	}
+	ASSERT_EQ(5, dropped);
+	
+	// Rejecting is all or nothing: the unlimited subscriber doesn't see the intent either
+	std::atomic_int rejectedSum{0};
+	std::atomic_int unlimitedSum{0};
+	im.subscribe<NumberedIntent<19>>("rejecting", [&](const auto & i) { rejectedSum += i.value; });
+	im.subscribe<NumberedIntent<19>>("unlimited", [&](const auto & i) { unlimitedSum += i.value; });
+	im.setQueueLimit<NumberedIntent<19>>("rejecting", 1, jlcommon::IntentOverflowPolicy::REJECT);
+	ASSERT_EQ(2, im.broadcast(NumberedIntent<19>(1)));
+	auto rejected = im.broadcast(NumberedIntent<19>(2));
+	ASSERT_TRUE(rejected.rejected);
+	ASSERT_EQ(0, rejected.handlers);
+	im.runUntilEmpty();
+	ASSERT_EQ(1, rejectedSum);
+	ASSERT_EQ(1, unlimitedSum);
+	ASSERT_EQ(2, im.broadcast(NumberedIntent<19>(4)));
+	im.runUntilEmpty();
+	ASSERT_EQ(5, rejectedSum);
+	
+	// Blocking holds the broadcaster back until the subscriber catches up
+	std::atomic_int blockedSum{0};
+	im.subscribe<NumberedIntent<20>>("blocking", [&](const auto & i) { blockedSum += i.value; });
+	im.setQueueLimit<NumberedIntent<20>>(1, jlcommon::IntentOverflowPolicy::BLOCK);
+	std::atomic_uint blocked{0};
+	std::thread broadcaster([&] {
+		for (int i = 1; i <= 3; i++)
+			blocked += im.broadcast(NumberedIntent<20>(i)).blocked;
+	});
+	auto getStats = [&](const std::string & subscriber) {
+		for (auto & stats : im.getIntentQueueStats()) {
+			if (stats.subscriber == subscriber)
+				return stats;
+		}
+		return jlcommon::IntentQueueStats{};
+	};
+	WAIT_FOR_TRUE((getStats("blocking").blocked == 1));
+	ASSERT_EQ(1, getStats("blocking").pending);
+	ASSERT_EQ(0, blockedSum);
+	while (blockedSum != 6) {
+		im.runUntilEmpty();
+		std::this_thread::yield();
+	}
+	broadcaster.join();
+	ASSERT_GE(blocked, 1);
+	ASSERT_EQ(blocked, getStats("blocking").blocked);
+	ASSERT_EQ(1, getStats("rejecting").rejected);
+}
+
+TEST(TestIntentManager, TestExecutors) {
+	using namespace std::chrono_literals;
+	cpu_set_t allowed;
+	ASSERT_EQ(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &allowed))
+		cpu++;
+	
+	jlcommon::IntentManager im;
+	std::atomic<std::thread::id> heavyThread{};
+	std::atomic<std::thread::id> lightThread{};
+	std::atomic_int heavyCpu{-1};
+	im.subscribe<NumberedIntent<22>>("heavy", [&](const auto & i) {
+		heavyThread = std::this_thread::get_id();
+		heavyCpu = sched_getcpu();
+	});
+	im.subscribe<NumberedIntent<22>>("light", [&](const auto & i) { lightThread = std::this_thread::get_id(); });
+	im.setExecutor("heavy", jlcommon::IntentExecutor::createDedicated(cpu));
+	ASSERT_EQ(2, im.broadcast(NumberedIntent<22>(1)));
+	// The heavy subscriber runs on its own thread without anyone calling run(), while the light one still waits for it
+	WAIT_FOR_TRUE((heavyCpu != -1));
+	ASSERT_EQ(cpu, heavyCpu);
+	ASSERT_NE(std::this_thread::get_id(), heavyThread.load());
+	ASSERT_EQ(std::thread::id{}, lightThread.load());
+	im.runUntilEmpty();
+	ASSERT_EQ(std::this_thread::get_id(), lightThread.load());
+	
+	// Posted and scheduled tasks follow the subscriber to its executor
+	std::atomic<std::thread::id> taskThread{};
+	im.post("heavy", [&] { taskThread = std::this_thread::get_id(); });
+	im.runUntilEmpty();
+	ASSERT_EQ(heavyThread.load(), taskThread.load());
+	std::atomic_int ticks{0};
+	std::atomic_bool tickedElsewhere{false};
+	auto task = im.scheduleAtFixedRate("heavy", 0ms, 5ms, [&] {
+		if (std::this_thread::get_id() != heavyThread.load())
+			tickedElsewhere = true;
+		ticks++;
+	});
+	WAIT_FOR_TRUE((ticks >= 3));
+	task.cancel();
+	im.runUntilEmpty();
+	const int cancelledAt = ticks;
+	std::this_thread::sleep_for(20ms);
+	ASSERT_GE(cancelledAt, 3);
+	ASSERT_EQ(cancelledAt, ticks);
+	ASSERT_FALSE(tickedElsewhere);
+	
+	// In serial mode a subscriber only moves once run() has none of its intents left, so it never runs on both
+	std::vector<int> late;
+	std::atomic<std::thread::id> lateThread{};
+	im.subscribe<NumberedIntent<22>>("late", [&](const auto & i) {
+		late.push_back(i.value);
+		lateThread = std::this_thread::get_id();
+	});
+	im.broadcast(NumberedIntent<22>(2));
+	im.broadcast(NumberedIntent<22>(3));
+	im.setExecutor("late", jlcommon::IntentExecutor::createDedicated());
+	im.broadcast(NumberedIntent<22>(4));
+	std::this_thread::sleep_for(10ms);
+	ASSERT_TRUE(late.empty());
+	im.runUntilEmpty();
+	ASSERT_EQ(std::vector<int>({2, 3, 4}), late);
+	ASSERT_EQ(std::this_thread::get_id(), lateThread.load());
+	im.broadcast(NumberedIntent<22>(5));
+	im.runUntilEmpty();
+	ASSERT_EQ(std::vector<int>({2, 3, 4, 5}), late);
+	ASSERT_NE(std::this_thread::get_id(), lateThread.load());
+}
+
 class CustomService1 final : public jlcommon::Service {
 	public:
 	static volatile bool initialized;
@@ -344,6 +1268,337 @@ TEST(TestServiceManager, TestStartRunStop) {
 	ASSERT_TRUE(initialized);
 }
 
+class DependentService final : public jlcommon::Service {
+	public:
+	DependentService(std::string name, std::vector<std::string> dependencies, std::vector<std::string> & events, std::mutex & eventLock, bool succeed = true) :
+			mName(std::move(name)), mDependencies(std::move(dependencies)), mEvents(events), mEventLock(eventLock), mSucceed(succeed) { }
+	
+	bool initialize() override {
+		initBegin = nextSequence();
+		const bool succeeded = record("init", 30);
+		initEnd = nextSequence();
+		return succeeded;
+	}
+	bool start() override { return record("start", 0); }
+	bool stop() override { return record("stop", 0); }
+	bool terminate() override { return record("term", 0); }
+	[[nodiscard]] std::string name() const noexcept override { return mName; }
+	[[nodiscard]] std::vector<std::string> getDependencies() const override { return mDependencies; }
+	
+	std::atomic_int initBegin{-1}; // sequence numbers of the last initialize(), shared by every instance
+	std::atomic_int initEnd{-1};
+	
+	private:
+	const std::string mName;
+	const std::vector<std::string> mDependencies;
+	std::vector<std::string> & mEvents;
+	std::mutex & mEventLock;
+	const bool mSucceed;
+	
+	bool record(const std::string & phase, int delayMilliseconds) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(delayMilliseconds));
+		std::lock_guard<std::mutex> lk(mEventLock);
+		mEvents.push_back(phase + " " + mName);
+		return mSucceed || phase != "init";
+	}
+	
+	static int nextSequence() {
+		static std::atomic_int sequence{0};
+		return sequence++;
+	}
+};
+
+TEST(TestServiceManager, TestDependencyOrder) {
+	std::vector<std::string> events;
+	std::mutex eventLock;
+	auto indexOf = [&](const std::string & event) {
+		return std::find(events.begin(), events.end(), event) - events.begin();
+	};
+	
+	auto api = std::make_shared<DependentService>("api", std::vector<std::string>{"cache", "socket"}, events, eventLock);
+	auto cache = std::make_shared<DependentService>("cache", std::vector<std::string>{}, events, eventLock);
+	auto socket = std::make_shared<DependentService>("socket", std::vector<std::string>{}, events, eventLock);
+	auto metrics = std::make_shared<DependentService>("metrics", std::vector<std::string>{}, events, eventLock);
+	jlcommon::Manager<jlcommon::Service> manager;
+	manager.addChild(api);
+	manager.addChild(cache);
+	manager.addChild(socket);
+	manager.addChild(metrics);
+	manager.setLifecycleThreads(4);
+	
+	ASSERT_TRUE(manager.initialize());
+	// The three independent services initialize together, then the one that needs two of them
+	const int firstEnd = std::min({cache->initEnd.load(), socket->initEnd.load(), metrics->initEnd.load()});
+	for (auto & independent : {cache, socket, metrics})
+		ASSERT_LT(independent->initBegin, firstEnd);
+	ASSERT_GT(api->initBegin, cache->initEnd);
+	ASSERT_GT(api->initBegin, socket->initEnd);
+	ASSERT_TRUE(manager.start());
+	ASSERT_TRUE(manager.stop());
+	ASSERT_TRUE(manager.terminate());
+	ASSERT_EQ(16, events.size());
+	for (std::string dependency : {"cache", "socket"}) {
+		ASSERT_LT(indexOf("init " + dependency), indexOf("init api"));
+		ASSERT_LT(indexOf("start " + dependency), indexOf("start api"));
+		ASSERT_GT(indexOf("stop " + dependency), indexOf("stop api"));
+		ASSERT_GT(indexOf("term " + dependency), indexOf("term api"));
+	}
+}
+
+TEST(TestServiceManager, TestDependencyFailure) {
+	std::vector<std::string> events;
+	std::mutex eventLock;
+	jlcommon::Manager<jlcommon::Service> manager;
+	manager.addChild(std::make_shared<DependentService>("database", std::vector<std::string>{}, events, eventLock, false));
+	manager.addChild(std::make_shared<DependentService>("api", std::vector<std::string>{"database"}, events, eventLock));
+	manager.addChild(std::make_shared<DependentService>("metrics", std::vector<std::string>{}, events, eventLock));
+	manager.setLifecycleThreads(2);
+	ASSERT_FALSE(manager.initialize());
+	// api never initializes, and whatever did initialize is terminated again
+	ASSERT_EQ(events.end(), std::find(events.begin(), events.end(), "init api"));
+	ASSERT_NE(events.end(), std::find(events.begin(), events.end(), "term metrics"));
+	ASSERT_EQ(events.end(), std::find(events.begin(), events.end(), "term database"));
+	
+	jlcommon::Manager<jlcommon::Service> cyclic;
+	cyclic.addChild(std::make_shared<DependentService>("a", std::vector<std::string>{"b"}, events, eventLock));
+	cyclic.addChild(std::make_shared<DependentService>("b", std::vector<std::string>{"a"}, events, eventLock));
+	ASSERT_FALSE(cyclic.initialize());
+	
+	jlcommon::Manager<jlcommon::Service> missing;
+	missing.addChild(std::make_shared<DependentService>("a", std::vector<std::string>{"unknown"}, events, eventLock));
+	ASSERT_FALSE(missing.initialize());
+}
+
+class PushingService final : public jlcommon::Service {
+	public:
+	std::atomic_bool started{false};
+	
+	bool start() override { started = true; return true; }
+	bool stop() override { started = false; return true; }
+	[[nodiscard]] bool reportsHealth() const noexcept override { return true; }
+	inline void setHealth(jlcommon::ServiceHealth health) { reportHealth(health); }
+};
+
+TEST(TestServiceManager, TestHealthPush) {
+	auto first = std::make_shared<PushingService>();
+	auto second = std::make_shared<PushingService>();
+	auto inner = std::make_shared<jlcommon::Manager<jlcommon::Service>>();
+	inner->addChild(second);
+	jlcommon::Manager<jlcommon::Service> manager;
+	manager.addChild(first);
+	manager.addChild(inner);
+	ASSERT_TRUE(manager.reportsHealth());
+	
+	std::atomic_bool returned{false};
+	std::thread runner([&] { manager.startRunStop(); returned = true; });
+	WAIT_FOR_TRUE((first->started && second->started));
+	
+	first->setHealth(jlcommon::ServiceHealth::DEGRADED);
+	ASSERT_EQ(jlcommon::ServiceHealth::DEGRADED, manager.getHealth());
+	usleep(20000);
+	ASSERT_FALSE(returned); // degraded is still operational
+	
+	// A failure deep inside a nested manager wakes the top-level one right away
+	auto failedAt = std::chrono::steady_clock::now();
+	second->setHealth(jlcommon::ServiceHealth::FAILED);
+	WAIT_FOR_TRUE(returned);
+	ASSERT_LT(std::chrono::steady_clock::now() - failedAt, std::chrono::milliseconds(50));
+	runner.join();
+	ASSERT_FALSE(first->started);
+	ASSERT_FALSE(second->started);
+	
+	second->setHealth(jlcommon::ServiceHealth::OPERATIONAL);
+	returned = false;
+	std::thread stopped([&] { manager.startRunStop(); returned = true; });
+	WAIT_FOR_TRUE((first->started && second->started));
+	manager.requestStop();
+	WAIT_FOR_TRUE(returned);
+	ASSERT_TRUE(returned);
+	stopped.join();
+}
+
+class AccountedService final : public jlcommon::Service {
+	public:
+	AccountedService(std::string name, std::chrono::milliseconds work) : mName(std::move(name)), mWork(work) { }
+	
+	bool initialize() override {
+		subscribe<NumberedIntent<21>>(getIntentManager(), [this](const auto & i) { spin(); });
+		return true;
+	}
+	
+	void runTask() {
+		accounted([this] {
+			jlcommon::ResourceAccount::recordAllocation(128);
+			spin();
+		})();
+	}
+	
+	void postTask() {
+		execute([this] { spin(); });
+	}
+	
+	[[nodiscard]] std::string name() const noexcept override { return mName; }
+	
+	private:
+	const std::string mName;
+	const std::chrono::milliseconds mWork;
+	
+	void spin() const {
+		const uint64_t end = jlcommon::ResourceAccount::getThreadCpuNanoseconds() + std::chrono::duration_cast<std::chrono::nanoseconds>(mWork).count();
+		while (jlcommon::ResourceAccount::getThreadCpuNanoseconds() < end);
+	}
+};
+
+TEST(TestServiceManager, TestResourceAccounting) {
+	using namespace std::chrono_literals;
+	auto im = std::make_shared<jlcommon::IntentManager>();
+	im->setResourceAccounting(true);
+	auto busy = std::make_shared<AccountedService>("busy", 5ms);
+	auto idle = std::make_shared<AccountedService>("idle", 0ms);
+	auto inner = std::make_shared<jlcommon::Manager<jlcommon::Service>>();
+	inner->addChild(idle);
+	jlcommon::Manager<jlcommon::Service> manager;
+	manager.addChild(busy);
+	manager.addChild(inner);
+	manager.setIntentManager(im);
+	ASSERT_TRUE(manager.initialize());
+	
+	for (int i = 0; i < 4; i++)
+		im->broadcast(NumberedIntent<21>(i));
+	im->runUntilEmpty();
+	busy->runTask();
+	busy->postTask();
+	im->runUntilEmpty();
+	
+	auto snapshot = manager.getResourceSnapshot();
+	ASSERT_EQ(2, snapshot.children.size());
+	const auto & busyUsage = snapshot.children[0].own;
+	const auto & idleUsage = snapshot.children[1].children[0].own;
+	ASSERT_EQ("busy", snapshot.children[0].name);
+	ASSERT_EQ(4, busyUsage.intents);
+	ASSERT_EQ(2, busyUsage.tasks);
+	ASSERT_EQ(128, busyUsage.allocatedBytes);
+	ASSERT_GE(busyUsage.cpuNanoseconds, 30000000);
+	ASSERT_EQ("idle", snapshot.children[1].children[0].name);
+	ASSERT_EQ(4, idleUsage.intents);
+	ASSERT_LT(idleUsage.cpuNanoseconds, busyUsage.cpuNanoseconds / 10);
+	ASSERT_EQ(8, snapshot.total.intents);
+	ASSERT_EQ(busyUsage.cpuNanoseconds + idleUsage.cpuNanoseconds, snapshot.total.cpuNanoseconds);
+	ASSERT_TRUE(manager.terminate());
+}
+
+TEST(TestServiceManager, TestResourceAccountingSameName) {
+	auto im = std::make_shared<jlcommon::IntentManager>();
+	im->setResourceAccounting(true);
+	auto first = std::make_shared<AccountedService>("twin", std::chrono::milliseconds(0));
+	auto second = std::make_shared<AccountedService>("twin", std::chrono::milliseconds(0));
+	jlcommon::Manager<jlcommon::Service> manager;
+	manager.addChild(first);
+	manager.addChild(second);
+	manager.setIntentManager(im);
+	ASSERT_TRUE(manager.initialize());
+	
+	im->broadcast(NumberedIntent<21>(0));
+	im->runUntilEmpty();
+	ASSERT_EQ(1, first->getResourceSnapshot().own.intents);
+	ASSERT_EQ(1, second->getResourceSnapshot().own.intents);
+	ASSERT_TRUE(manager.terminate());
+}
+
+TEST(TestServiceManager, TestLifecycleProfile) {
+	std::vector<std::string> events;
+	std::mutex eventLock;
+	auto inner = std::make_shared<jlcommon::Manager<jlcommon::Service>>();
+	inner->addChild(std::make_shared<DependentService>("api", std::vector<std::string>{}, events, eventLock));
+	jlcommon::Manager<jlcommon::Service> manager;
+	manager.addChild(std::make_shared<DependentService>("cache", std::vector<std::string>{}, events, eventLock));
+	manager.addChild(inner);
+	ASSERT_TRUE(manager.initialize());
+	
+	auto profile = manager.getLifecycleProfile();
+	ASSERT_EQ(2, profile.children.size());
+	const auto & root = profile.getPhase(jlcommon::LifecyclePhase::INITIALIZE);
+	const auto & cache = profile.children[0].getPhase(jlcommon::LifecyclePhase::INITIALIZE);
+	const auto & api = profile.children[1].children[0].getPhase(jlcommon::LifecyclePhase::INITIALIZE);
+	ASSERT_EQ("cache", profile.children[0].name);
+	ASSERT_EQ("api", profile.children[1].children[0].name);
+	ASSERT_TRUE(root.ran && root.succeeded);
+	ASSERT_GE(cache.durationNanoseconds, 30000000);
+	ASSERT_GE(api.durationNanoseconds, 30000000);
+	ASSERT_GE(profile.children[1].getPhase(jlcommon::LifecyclePhase::INITIALIZE).durationNanoseconds, api.durationNanoseconds);
+	ASSERT_GE(root.durationNanoseconds, cache.durationNanoseconds + api.durationNanoseconds);
+	ASSERT_GE(api.beginNanoseconds, cache.getEndNanoseconds());
+	ASSERT_FALSE(profile.getPhase(jlcommon::LifecyclePhase::START).ran);
+	
+	ASSERT_TRUE(manager.start());
+	ASSERT_TRUE(manager.stop());
+	ASSERT_TRUE(manager.terminate());
+	profile = manager.getLifecycleProfile();
+	for (size_t phase = 0; phase < jlcommon::LIFECYCLE_PHASE_COUNT; phase++)
+		ASSERT_TRUE(profile.children[1].children[0].phases[phase].succeeded);
+	
+	const auto report = profile.getReport();
+	ASSERT_NE(std::string::npos, report.find("\n  cache "));
+	ASSERT_NE(std::string::npos, report.find("\n    api "));
+	const auto json = profile.getJson();
+	ASSERT_EQ(0, json.find("{\"name\":\"Manager\",\"phases\":{\"initialize\":{\"begin\":"));
+	ASSERT_NE(std::string::npos, json.find("\"children\":[{\"name\":\"api\",\"phases\":{\"initialize\":"));
+	ASSERT_NE(std::string::npos, json.find("\"terminate\":{\"begin\":"));
+}
+
+class TickingService final : public jlcommon::Service {
+	public:
+	explicit TickingService(std::string name) : mName(std::move(name)) { }
+	
+	bool start() override {
+		subscribe<NumberedIntent<22>>(getIntentManager(), [this](const auto & i) { intentThread = std::this_thread::get_id(); });
+		mTicker = scheduleAtFixedRate(std::chrono::milliseconds(0), std::chrono::milliseconds(5), [this] {
+			tickThread = std::this_thread::get_id();
+			ticks++;
+		});
+		return mTicker.isValid();
+	}
+	
+	bool stop() override {
+		mTicker.cancel();
+		return true;
+	}
+	
+	[[nodiscard]] std::string name() const noexcept override { return mName; }
+	
+	std::atomic<std::thread::id> intentThread{};
+	std::atomic<std::thread::id> tickThread{};
+	std::atomic_int ticks{0};
+	
+	private:
+	const std::string mName;
+	jlcommon::ScheduledTask mTicker;
+};
+
+TEST(TestServiceManager, TestExecutorAffinity) {
+	auto im = std::make_shared<jlcommon::IntentManager>();
+	auto isolated = std::make_shared<TickingService>("isolated");
+	auto shared = std::make_shared<TickingService>("shared");
+	jlcommon::Manager<jlcommon::Service> manager;
+	manager.addChild(isolated, jlcommon::IntentExecutor::createDedicated());
+	manager.addChild(shared);
+	manager.setIntentManager(im);
+	ASSERT_TRUE(manager.initialize());
+	ASSERT_TRUE(manager.start());
+	
+	im->broadcast(NumberedIntent<22>(1));
+	WAIT_FOR_TRUE((isolated->ticks >= 2 && isolated->intentThread.load() != std::thread::id{}));
+	// The isolated service handles intents and timers on its own thread, while the other waits for the intent loop
+	ASSERT_NE(std::thread::id{}, isolated->intentThread.load());
+	ASSERT_NE(std::this_thread::get_id(), isolated->intentThread.load());
+	ASSERT_EQ(isolated->intentThread.load(), isolated->tickThread.load());
+	ASSERT_EQ(std::thread::id{}, shared->intentThread.load());
+	im->runUntilEmpty();
+	ASSERT_EQ(std::this_thread::get_id(), shared->intentThread.load());
+	ASSERT_TRUE(manager.stop());
+	ASSERT_TRUE(manager.terminate());
+}
+
 int main(int argc, char *argv[]) {
 	testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();